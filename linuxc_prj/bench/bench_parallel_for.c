@@ -0,0 +1,137 @@
+// bench/bench_parallel_for.c
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "thread_pool.h"
+
+#define DEFAULT_ELEMENTS  (1L << 20)
+#define DEFAULT_THREADS   8
+#define FILTER_ROUNDS     64
+#define REPEAT            5
+
+/**
+ * @brief Get current timestamp (nanoseconds)
+ * @return Current monotonic timestamp (nanoseconds)
+ */
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Run a low-pass filter over each sample of a chunk
+ * @param begin First sample index
+ * @param end One past the last sample index
+ * @param ctx Sample buffer
+ */
+static void filter_chunk(long begin, long end, void *ctx)
+{
+    float *samples = ctx;
+
+    for (long i = begin; i < end; i++) {
+        float y = samples[i];
+        for (int r = 0; r < FILTER_ROUNDS; r++) {
+            y = y * 0.9f + (float)r * 0.1f;
+        }
+        samples[i] = y;
+    }
+}
+
+/**
+ * @brief Fill the sample buffer with a deterministic ramp
+ * @param samples Sample buffer
+ * @param n Number of samples
+ */
+static void fill_samples(float *samples, long n)
+{
+    for (long i = 0; i < n; i++) {
+        samples[i] = (float)(i % 4096);
+    }
+}
+
+/**
+ * @brief Best of REPEAT runs of a serial loop
+ * @param samples Sample buffer
+ * @param n Number of samples
+ * @return Elapsed time (nanoseconds)
+ */
+static unsigned long long bench_serial(float *samples, long n)
+{
+    unsigned long long best = ~0ULL;
+
+    for (int r = 0; r < REPEAT; r++) {
+        fill_samples(samples, n);
+        unsigned long long start = now_ns();
+        filter_chunk(0, n, samples);
+        unsigned long long elapsed = now_ns() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+/**
+ * @brief Best of REPEAT runs of thpool_parallel_for
+ * @param thpool Thread pool to run on
+ * @param samples Sample buffer
+ * @param n Number of samples
+ * @param grain Smallest chunk size (<= 0: automatic)
+ * @return Elapsed time (nanoseconds)
+ */
+static unsigned long long bench_parallel(threadpool thpool, float *samples, long n, long grain)
+{
+    unsigned long long best = ~0ULL;
+
+    for (int r = 0; r < REPEAT; r++) {
+        fill_samples(samples, n);
+        unsigned long long start = now_ns();
+        thpool_parallel_for(thpool, 0, n, grain, filter_chunk, samples);
+        unsigned long long elapsed = now_ns() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+/**
+ * @brief Benchmark entry
+ *
+ * Usage: bench_parallel_for [elements] [max threads]
+ */
+int main(int argc, char *argv[])
+{
+    long n = argc > 1 ? atol(argv[1]) : DEFAULT_ELEMENTS;
+    int max_threads = argc > 2 ? atoi(argv[2]) : DEFAULT_THREADS;
+
+    float *samples = malloc(n * sizeof(float));
+    if (samples == NULL) {
+        fprintf(stderr, "Failed to allocate %ld samples\n", n);
+        return 1;
+    }
+
+    unsigned long long serial = bench_serial(samples, n);
+    printf("elements %ld, %d filter rounds each, best of %d\n", n, FILTER_ROUNDS, REPEAT);
+    printf("%-8s %-8s %12s %8s\n", "threads", "grain", "time(ms)", "speedup");
+    printf("%-8s %-8s %12.3f %8.2f\n", "serial", "-", serial / 1e6, 1.0);
+
+    for (int t = 1; t <= max_threads; t *= 2) {
+        threadpool thpool = thpool_init(t);
+        long grains[] = { 0, 1024 };
+        for (unsigned g = 0; g < sizeof(grains) / sizeof(grains[0]); g++) {
+            unsigned long long elapsed = bench_parallel(thpool, samples, n, grains[g]);
+            char grain_str[24];
+            if (grains[g] > 0)
+                snprintf(grain_str, sizeof(grain_str), "%ld", grains[g]);
+            else
+                snprintf(grain_str, sizeof(grain_str), "auto");
+            printf("%-8d %-8s %12.3f %8.2f\n", t, grain_str, elapsed / 1e6, (double)serial / elapsed);
+        }
+        thpool_destroy(thpool);
+    }
+
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,257 @@
+// bench/bench_thpool.c
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "thread_pool.h"
+
+#define DEFAULT_THREADS     4
+#define DEFAULT_PRODUCERS   4
+#define DEFAULT_JOBS        100000
+#define ROUND_TRIPS         20000
+#define FAN_OUT             64
+#define FAN_ROUNDS          2000
+#define WAIT_ROUNDS         20000
+
+/* One producer of the submit throughput run */
+typedef struct producer {
+    pthread_t thread;
+    threadpool thpool;
+    atomic_int *start;
+    long num_jobs;
+    unsigned long long *samples;    /* time of each thpool_add_work call */
+} producer;
+
+/**
+ * @brief Get current timestamp (nanoseconds)
+ * @return Current monotonic timestamp (nanoseconds)
+ */
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Job that does nothing, so only pool overhead is measured
+ * @param arg Unused
+ */
+static void empty_job(void *arg)
+{
+    (void)arg;
+}
+
+/**
+ * @brief Future job that does nothing
+ * @param arg Unused
+ * @return NULL
+ */
+static void *empty_task(void *arg)
+{
+    (void)arg;
+    return NULL;
+}
+
+/**
+ * @brief qsort comparator for samples
+ */
+static int compare_samples(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Sort samples and print one row of percentiles (nanoseconds)
+ * @param label Row label
+ * @param samples Samples, sorted in place
+ * @param n Number of samples
+ */
+static void print_percentiles(const char *label, unsigned long long *samples, long n)
+{
+    if (n <= 0)
+        return;
+    qsort(samples, n, sizeof(samples[0]), compare_samples);
+    printf("%-28s %9llu %9llu %9llu %9llu %9llu\n", label,
+           samples[n / 2], samples[n * 90 / 100], samples[n * 99 / 100],
+           samples[n * 999 / 1000], samples[n - 1]);
+}
+
+/**
+ * @brief Producer thread, submits its share of empty jobs as fast as it can
+ * @param arg Producer
+ * @return NULL
+ */
+static void *producer_run(void *arg)
+{
+    producer *p = arg;
+
+    while (!atomic_load(p->start)) {
+    }
+    for (long i = 0; i < p->num_jobs; i++) {
+        unsigned long long start = now_ns();
+        thpool_add_work(p->thpool, empty_job, NULL);
+        p->samples[i] = now_ns() - start;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Submit throughput with 1..max_producers threads submitting at once
+ * @param thpool Thread pool to run on
+ * @param max_producers Largest number of producers
+ * @param num_jobs Jobs per producer
+ */
+static void bench_submit(threadpool thpool, int max_producers, long num_jobs)
+{
+    producer *producers = calloc(max_producers, sizeof(producer));
+    unsigned long long *samples = malloc(max_producers * num_jobs * sizeof(unsigned long long));
+    if (producers == NULL || samples == NULL) {
+        fprintf(stderr, "Failed to allocate %ld samples\n", max_producers * num_jobs);
+        exit(1);
+    }
+
+    printf("\nsubmit throughput, %ld empty jobs per producer, thpool_add_work latency (ns)\n", num_jobs);
+    printf("%-10s %17s %9s %9s %9s %9s %9s\n", "producers", "jobs/s", "p50", "p90", "p99", "p99.9", "max");
+    for (int n = 1; n <= max_producers; n = n < max_producers && n * 2 > max_producers ? max_producers : n * 2) {
+        atomic_int start = 0;
+        for (int i = 0; i < n; i++) {
+            producers[i].thpool = thpool;
+            producers[i].start = &start;
+            producers[i].num_jobs = num_jobs;
+            producers[i].samples = samples + i * num_jobs;
+            pthread_create(&producers[i].thread, NULL, producer_run, &producers[i]);
+        }
+
+        unsigned long long begin = now_ns();
+        atomic_store(&start, 1);
+        for (int i = 0; i < n; i++)
+            pthread_join(producers[i].thread, NULL);
+        thpool_wait(thpool);
+        unsigned long long elapsed = now_ns() - begin;
+
+        char label[48];
+        snprintf(label, sizeof(label), "%-10d %17.0f", n, (double)n * num_jobs * 1e9 / elapsed);
+        print_percentiles(label, samples, n * num_jobs);
+    }
+
+    free(samples);
+    free(producers);
+}
+
+/**
+ * @brief Submit one empty job and wait for it, ROUND_TRIPS times
+ * @param thpool Thread pool to run on
+ */
+static void bench_round_trip(threadpool thpool)
+{
+    unsigned long long *samples = malloc(ROUND_TRIPS * sizeof(unsigned long long));
+    if (samples == NULL)
+        exit(1);
+
+    for (long i = 0; i < ROUND_TRIPS; i++) {
+        unsigned long long start = now_ns();
+        thpool_future future = thpool_submit(thpool, empty_task, NULL);
+        thpool_future_wait(future, NULL);
+        samples[i] = now_ns() - start;
+        thpool_future_release(future);
+    }
+    print_percentiles("round trip", samples, ROUND_TRIPS);
+    free(samples);
+}
+
+/**
+ * @brief Submit FAN_OUT empty jobs in one batch and wait for all of them
+ * @param thpool Thread pool to run on
+ */
+static void bench_fan_out(threadpool thpool)
+{
+    unsigned long long *samples = malloc(FAN_ROUNDS * sizeof(unsigned long long));
+    if (samples == NULL)
+        exit(1);
+
+    void (*funcs[FAN_OUT])(void *);
+    void *args[FAN_OUT];
+    for (int i = 0; i < FAN_OUT; i++) {
+        funcs[i] = empty_job;
+        args[i] = NULL;
+    }
+
+    for (long i = 0; i < FAN_ROUNDS; i++) {
+        unsigned long long start = now_ns();
+        thpool_add_work_batch(thpool, funcs, args, FAN_OUT);
+        thpool_wait(thpool);
+        samples[i] = now_ns() - start;
+    }
+
+    char label[32];
+    snprintf(label, sizeof(label), "fan-out/fan-in x%d", FAN_OUT);
+    print_percentiles(label, samples, FAN_ROUNDS);
+    free(samples);
+}
+
+/**
+ * @brief Cost of thpool_wait on a pool with nothing pending
+ * @param thpool Thread pool to run on
+ */
+static void bench_wait(threadpool thpool)
+{
+    unsigned long long *samples = malloc(WAIT_ROUNDS * sizeof(unsigned long long));
+    if (samples == NULL)
+        exit(1);
+
+    for (long i = 0; i < WAIT_ROUNDS; i++) {
+        unsigned long long start = now_ns();
+        thpool_wait(thpool);
+        samples[i] = now_ns() - start;
+    }
+    print_percentiles("thpool_wait (idle)", samples, WAIT_ROUNDS);
+    free(samples);
+}
+
+/**
+ * @brief Benchmark entry
+ *
+ * Usage: bench_thpool [threads] [max producers] [jobs per producer] [list|ring|edf]
+ *
+ * Save the output of a run as baseline and diff it against the output
+ * after changing the queue or wakeup path.
+ */
+int main(int argc, char *argv[])
+{
+    int num_threads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+    int max_producers = argc > 2 ? atoi(argv[2]) : DEFAULT_PRODUCERS;
+    long num_jobs = argc > 3 ? atol(argv[3]) : DEFAULT_JOBS;
+    const char *queue = argc > 4 ? argv[4] : "list";
+
+    thpool_config config;
+    thpool_config_init(&config);
+    config.num_threads = num_threads;
+    if (strcasecmp(queue, "ring") == 0)
+        config.queue_type = THPOOL_QUEUE_RING;
+    else if (strcasecmp(queue, "edf") == 0)
+        config.queue_type = THPOOL_QUEUE_EDF;
+
+    threadpool thpool = thpool_init_ex(&config);
+    if (thpool == NULL) {
+        fprintf(stderr, "Failed to create thread pool\n");
+        return 1;
+    }
+
+    printf("threads %d, queue %s\n", num_threads, queue);
+    bench_submit(thpool, max_producers, num_jobs);
+
+    printf("\n%-28s %9s %9s %9s %9s %9s\n", "latency (ns)", "p50", "p90", "p99", "p99.9", "max");
+    bench_round_trip(thpool);
+    bench_fan_out(thpool);
+    bench_wait(thpool);
+
+    thpool_destroy(thpool);
+    return 0;
+}
@@ -40,26 +40,57 @@ int main_init(int argc, char *argv[])
     // Config initialization
     config_initialize("app.conf", config);
     logger_init(NULL, config->debug, 1);
+    logger_set_time_precision(config->log_time_precision);
+    if (config->log_async) {
+        logger_async_start(config->log_slots, config->log_overflow);
+    }
+    if (config->log_binary[0] != '\0') {
+        logger_binary_start(config->log_binary);
+    }
 
     // Command parsing
     if(argc > 1) {
         config->loop = command_parsing(argv);
-        if(config->loop == 0)
+        if(config->loop == 0) {
+            logger_async_stop();
             return 0;
+        }
     }
 
     // Process thread task
-    threadpool thpool = thpool_init(config->nthread);
-	thpool_add_work(thpool, PrivateTask, NULL);
+    thpool_config thconf;
+    thpool_config_init(&thconf);
+    thconf.num_threads    = config->nthread;
+    thconf.max_threads    = config->nthread_max;
+    thconf.spawn_wait_ms  = config->spawn_wait_ms;
+    thconf.idle_timeout_ms = config->idle_timeout_ms;
+    thconf.queue_type     = config->queue_type;
+    thconf.queue_capacity = config->queue_capacity;
+    thconf.job_slab_size  = config->job_slab_size;
+    thconf.name           = config->thread_name;
+    thconf.cpu_mask       = config->cpu_mask;
+    thconf.sched_policy   = config->sched_policy;
+    thconf.sched_priority = config->sched_priority;
+    thconf.stats          = config->thread_stats;
+    thconf.queue_limit    = config->queue_limit;
+    thconf.overflow       = config->overflow;
+    thconf.block_timeout_ms = config->block_timeout_ms;
+    thconf.spin_us        = config->spin_us;
+    threadpool thpool = thpool_init_ex(&thconf);
+
+    // Periodic work runs off the pool's timer wheel, not a thread of its own
+    thpool_timer private_task = thpool_schedule_every(thpool, 1000, PrivateTask, NULL);
 
     while (config->loop) {
         main_loop();
     }
 
+    thpool_timer_cancel(private_task);
     thpool_wait(thpool);
 	thpool_destroy(thpool);
 
     LOG_INFO("Program over");
+    logger_async_stop();
 
     return 0;
 }
@@ -78,13 +109,10 @@ int main_loop(void)
 }
 
 /**
- * @brief Private task processing function
+ * @brief Private task processing function, runs once a second
  * @param arg Task parameter (currently unused)
  */
 void PrivateTask(void* arg)
 {
-    for(;;) {
-
-        sleep(1);
-    }
+    (void)arg;
 }
@@ -3,8 +3,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <sched.h>
 #include "config.h"
 #include "logger.h"
+#include "thread_pool.h"
 
 typedef struct {
     char *key;
@@ -311,6 +313,40 @@ int config_get_bool(Config *config, const char *section, const char *key, int de
     return default_value;
 }
 
+/**
+ * @brief Parse a CPU list such as "0-1,3" into a bit mask
+ * @param str CPU list, CPU numbers and ranges separated by commas
+ * @return Bit mask with bit n set for CPU n, 0 if empty or invalid
+ */
+static unsigned long parse_cpu_list(const char *str) {
+    unsigned long mask = 0;
+    const int max_cpu = (int)(sizeof(mask) * 8) - 1;
+
+    while (*str) {
+        char *end;
+        long first = strtol(str, &end, 10);
+        long last = first;
+        if (end == str || first < 0 || first > max_cpu) {
+            return 0;
+        }
+        str = end;
+        if (*str == '-') {
+            last = strtol(str + 1, &end, 10);
+            if (end == str + 1 || last < first || last > max_cpu) {
+                return 0;
+            }
+            str = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            mask |= 1UL << cpu;
+        }
+        while (*str == ',' || isspace((unsigned char)*str)) {
+            str++;
+        }
+    }
+    return mask;
+}
+
 /**
  * @brief Initialize application configuration
  * @param filename Configuration file name
@@ -326,6 +362,30 @@ int config_initialize(const char* filename, struct main_config *app)
     app->debug = config_get_int(conf, "Logging", "level", 1);
     LOG_DEBUG("Main debug level = %d",app->debug);
 
+    // Asynchronous logging, callers queue lines for a writer thread
+    app->log_async = config_get_bool(conf, "Logging", "async", 0);
+    app->log_slots = config_get_int(conf, "Logging", "async_slots", 1024);
+    const char *log_overflow = config_get_string(conf, "Logging", "async_overflow", "drop");
+    app->log_overflow = strcasecmp(log_overflow, "block") == 0 ? LOG_OVERFLOW_BLOCK : LOG_OVERFLOW_DROP;
+    LOG_DEBUG("Async logging %s, %d slots, overflow %s",
+              app->log_async ? "Enable" : "Disable", app->log_slots, log_overflow);
+
+    // Sub-second digits of the log timestamp
+    const char *time_precision = config_get_string(conf, "Logging", "time_precision", "s");
+    if (strcasecmp(time_precision, "ms") == 0) {
+        app->log_time_precision = LOG_TIME_MSEC;
+    } else if (strcasecmp(time_precision, "us") == 0) {
+        app->log_time_precision = LOG_TIME_USEC;
+    } else {
+        app->log_time_precision = LOG_TIME_SEC;
+    }
+    LOG_DEBUG("Log timestamp precision %s", time_precision);
+
+    // Binary log file, LOG_* calls are recorded unformatted for logdecode
+    const char *binary = config_get_string(conf, "Logging", "binary", "");
+    snprintf(app->log_binary, sizeof(app->log_binary), "%s", binary);
+    LOG_DEBUG("Binary logging %s", app->log_binary[0] ? app->log_binary : "Disable");
+
     // Main loop enable
     app->loop = config_get_bool(conf, "Config", "main_loop", 1);
     LOG_DEBUG("Main loop %s",app->loop ? "Enable" : "Disable");
@@ -334,6 +394,69 @@ int config_initialize(const char* filename, struct main_config *app)
     app->nthread = config_get_int(conf, "Thread", "nthread", 1);
     LOG_DEBUG("The number of application threads is %d",app->nthread);
 
+    // Elastic thread pool, grows up to nthread_max under load
+    app->nthread_max = config_get_int(conf, "Thread", "nthread_max", 0);
+    app->spawn_wait_ms = config_get_int(conf, "Thread", "spawn_wait_ms", 10);
+    app->idle_timeout_ms = config_get_int(conf, "Thread", "idle_timeout_ms", 5000);
+    LOG_DEBUG("Thread pool max %d, spawn wait %d ms, idle timeout %d ms",
+              app->nthread_max, app->spawn_wait_ms, app->idle_timeout_ms);
+
+    // Thread pool job queue backend
+    const char *queue = config_get_string(conf, "Thread", "queue", "list");
+    if (strcasecmp(queue, "ring") == 0) {
+        app->queue_type = THPOOL_QUEUE_RING;
+    } else if (strcasecmp(queue, "edf") == 0) {
+        app->queue_type = THPOOL_QUEUE_EDF;
+    } else {
+        app->queue_type = THPOOL_QUEUE_LIST;
+    }
+    app->queue_capacity = config_get_int(conf, "Thread", "queue_capacity", 1024);
+    LOG_DEBUG("Thread pool queue %s, capacity %d", queue, app->queue_capacity);
+
+    // Preallocated thread pool job nodes
+    app->job_slab_size = config_get_int(conf, "Thread", "job_slab", 256);
+    LOG_DEBUG("Thread pool job slab %d",app->job_slab_size);
+
+    // Thread pool worker names, placement and scheduling
+    const char *name = config_get_string(conf, "Thread", "name", "thpool");
+    snprintf(app->thread_name, sizeof(app->thread_name), "%s", name);
+    app->cpu_mask = parse_cpu_list(config_get_string(conf, "Thread", "cpu_affinity", ""));
+    const char *policy = config_get_string(conf, "Thread", "sched_policy", "other");
+    if (strcasecmp(policy, "fifo") == 0) {
+        app->sched_policy = SCHED_FIFO;
+    } else if (strcasecmp(policy, "rr") == 0) {
+        app->sched_policy = SCHED_RR;
+    } else {
+        app->sched_policy = SCHED_OTHER;
+    }
+    app->sched_priority = config_get_int(conf, "Thread", "sched_priority", 0);
+    LOG_DEBUG("Thread pool name %s, cpu mask 0x%lx, policy %s, priority %d",
+              app->thread_name, app->cpu_mask, policy, app->sched_priority);
+
+    // Thread pool queue wait and run time histograms
+    app->thread_stats = config_get_bool(conf, "Thread", "stats", 0);
+    LOG_DEBUG("Thread pool stats %s",app->thread_stats ? "Enable" : "Disable");
+
+    // Bounded job queue and what producers get once it is full
+    app->queue_limit = config_get_int(conf, "Thread", "queue_limit", 0);
+    const char *overflow = config_get_string(conf, "Thread", "overflow", "block");
+    if (strcasecmp(overflow, "reject") == 0) {
+        app->overflow = THPOOL_OVERFLOW_REJECT;
+    } else if (strcasecmp(overflow, "drop_oldest") == 0) {
+        app->overflow = THPOOL_OVERFLOW_DROP_OLDEST;
+    } else if (strcasecmp(overflow, "caller_runs") == 0) {
+        app->overflow = THPOOL_OVERFLOW_CALLER_RUNS;
+    } else {
+        app->overflow = THPOOL_OVERFLOW_BLOCK;
+    }
+    app->block_timeout_ms = config_get_int(conf, "Thread", "block_timeout_ms", 0);
+    LOG_DEBUG("Thread pool queue limit %d, overflow %s, block timeout %d ms",
+              app->queue_limit, overflow, app->block_timeout_ms);
+
+    // Idle workers spin this long at most before sleeping, 0 saves power
+    app->spin_us = config_get_int(conf, "Thread", "spin_us", 50);
+    LOG_DEBUG("Thread pool idle spin %d us",app->spin_us);
+
     // Other configuration
 
     config_free(conf);
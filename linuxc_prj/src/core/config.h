@@ -5,7 +5,27 @@
 typedef struct main_config {
     int loop;
     int debug;
+    int log_async;
+    int log_slots;
+    int log_overflow;
+    int log_time_precision;
+    char log_binary[128];
     int nthread;
+    int nthread_max;
+    int spawn_wait_ms;
+    int idle_timeout_ms;
+    int queue_type;
+    int queue_capacity;
+    int job_slab_size;
+    char thread_name[16];
+    unsigned long cpu_mask;
+    int sched_policy;
+    int sched_priority;
+    int thread_stats;
+    int queue_limit;
+    int overflow;
+    int block_timeout_ms;
+    int spin_us;
 } Aconf;
 
 typedef struct Config Config;
@@ -1,16 +1,122 @@
 // src/core/logger.c
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 #include "logger.h"
+#include "logger_bin.h"
+
+// Bytes per async ring slot, longer lines are truncated
+#ifndef LOG_SLOT_SIZE
+#define LOG_SLOT_SIZE 256
+#endif
+
+// Lines the writer thread hands to one writev call
+#define LOG_BATCH 64
+
+// "[YYYY-mm-dd HH:MM:SS.uuuuuu] " plus the terminating NUL
+#define LOG_TIME_SIZE 32
+
+// Per-thread binary record buffer, written out when full
+#define LOG_BIN_BUFFER_SIZE (64 * 1024)
+
+// Largest payload of one binary record, long strings are cut to fit
+#define LOG_BIN_MAX_PAYLOAD 1024
+
+// Binary format strings the process can register
+#define LOG_BIN_MAX_FORMATS 1024
+
+// A thread's records are written out about once the oldest is this old
+#define LOG_BIN_FLUSH_NS 1000000000ULL
+
+// Timestamp prefix of the current second, one per thread
+typedef struct {
+    time_t sec;                     // second the text was built for
+    size_t len;                     // bytes up to the seconds digits
+    char text[LOG_TIME_SIZE];       // "[YYYY-mm-dd HH:MM:SS"
+} LogTimeCache;
+
+// One formatted line in the async ring
+typedef struct {
+    atomic_size_t seq;              // slot sequence number, whose turn it is
+    size_t len;                     // bytes used in text
+    char text[LOG_SLOT_SIZE];       // line including the newline
+} LogSlot;
+
+// Async mode: bounded MPSC ring of lines drained by one writer thread
+typedef struct {
+    LogSlot *slots;                 // ring storage
+    size_t mask;                    // capacity - 1
+    LogOverflow overflow;           // what callers do when it is full
+    atomic_int running;             // callers may queue lines
+    atomic_int num_callers;         // callers between the check and the publish
+    atomic_int num_blocked;         // callers waiting for room
+    atomic_int writer_idle;         // writer waits on has_lines
+    int stop;                       // writer drains and exits
+    atomic_ulong dropped;           // lines lost to a full ring
+    pthread_t thread;               // writer thread
+    pthread_mutex_t lock;           // used with the conditions below
+    pthread_cond_t has_lines;       // ring no longer empty
+    pthread_cond_t has_space;       // ring no longer full
+    size_t dequeue_pos;             // next slot to write, writer only
+    _Alignas(64) atomic_size_t enqueue_pos;
+} LogAsync;
 
 static FILE *log_file = NULL;
 static LogLevel log_level = LOG_LEVEL_INFO;
 static int log_console = 1;
+static LogTimePrecision log_time_precision = LOG_TIME_SEC;
+static _Thread_local LogTimeCache log_time_cache = { .sec = -1 };
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Argument list of a registered binary format, parsed once
+typedef struct {
+    int num_args;                   // entries used in args
+    struct {
+        uint8_t kind;               // LOG_ARG_*
+        uint8_t num_stars;          // int arguments before the value
+        char length;                // length modifier, see LogBinSpec
+        uint16_t reserve;           // fixed bytes the arguments after this one take
+    } args[LOG_BIN_MAX_ARGS];
+} LogBinFormat;
+
+// Records of one thread waiting to be written
+typedef struct LogBinBuffer {
+    atomic_flag busy;               // held by the owner appending or the flusher writing
+    struct LogBinBuffer *next;      // list the flusher walks
+    struct LogBinBuffer *prev;      // list the flusher walks
+    size_t len;                     // bytes used in data
+    uint64_t first_ns;              // time of the oldest record in data
+    uint8_t data[LOG_BIN_BUFFER_SIZE];
+} LogBinBuffer;
+
+static atomic_int log_bin_fd = -1;
+static pthread_mutex_t log_bin_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t log_bin_key;
+static int log_bin_num_formats = 0;
+static LogBinFormat log_bin_formats[LOG_BIN_MAX_FORMATS];
+static _Thread_local LogBinBuffer *log_bin_buffer = NULL;
+static pthread_mutex_t log_bin_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static LogBinBuffer *log_bin_buffers = NULL;
+
+static LogAsync log_async = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .has_lines = PTHREAD_COND_INITIALIZER,
+    .has_space = PTHREAD_COND_INITIALIZER,
+};
 
 /**
  * @brief Initialize logging system
@@ -32,49 +138,835 @@ void logger_init(const char *filename, LogLevel level, int console) {
 }
 
 /**
- * @brief Log message
+ * @brief Set the sub-second digits shown after the timestamp
+ * @param precision Seconds only, milliseconds or microseconds
+ */
+void logger_set_time_precision(LogTimePrecision precision) {
+    log_time_precision = precision;
+}
+
+/**
+ * @brief Write the timestamp prefix of a line
+ *
+ * localtime_r and strftime only run when the second changes, otherwise
+ * the thread's cached text is copied and the sub-second digits appended.
+ * Milliseconds come from CLOCK_REALTIME_COARSE; its tick is too coarse
+ * for microseconds, so those read CLOCK_REALTIME.
+ *
+ * @param buf Output buffer, at least LOG_TIME_SIZE bytes
+ * @return Bytes written, not counting the terminating NUL
+ */
+static size_t logger_timestamp(char *buf) {
+    struct timespec ts;
+    clock_gettime(log_time_precision == LOG_TIME_USEC ? CLOCK_REALTIME : CLOCK_REALTIME_COARSE, &ts);
+
+    LogTimeCache *cache = &log_time_cache;
+    if (ts.tv_sec != cache->sec) {
+        struct tm tm_info;
+        localtime_r(&ts.tv_sec, &tm_info);
+        cache->len = strftime(cache->text, sizeof(cache->text), "[%Y-%m-%d %H:%M:%S", &tm_info);
+        cache->sec = ts.tv_sec;
+    }
+
+    size_t len = cache->len;
+    memcpy(buf, cache->text, len);
+
+    int digits = log_time_precision == LOG_TIME_USEC ? 6 : log_time_precision == LOG_TIME_MSEC ? 3 : 0;
+    if (digits) {
+        long frac = digits == 6 ? ts.tv_nsec / 1000 : ts.tv_nsec / 1000000;
+        buf[len] = '.';
+        for (int i = digits; i > 0; i--) {
+            buf[len + i] = '0' + frac % 10;
+            frac /= 10;
+        }
+        len += digits + 1;
+    }
+    memcpy(buf + len, "] ", 3);
+    return len + 2;
+}
+
+/**
+ * @brief Get the printable name of a log level
+ * @param level Log level
+ * @return Level name
+ */
+static const char *logger_level_name(LogLevel level) {
+    switch (level) {
+        case LOG_LEVEL_DEBUG: return "DEBUG";
+        case LOG_LEVEL_INFO:  return "INFO";
+        case LOG_LEVEL_WARN:  return "WARN";
+        case LOG_LEVEL_ERROR: return "ERROR";
+        case LOG_LEVEL_FATAL: return "FATAL";
+        default:              return "UNKNOWN";
+    }
+}
+
+/**
+ * @brief Format a complete line, timestamp and level included
+ * @param buf Output buffer
+ * @param size Size of buf
  * @param level Log level
  * @param format Format string
- * @param ... Variable argument list
+ * @param args Variable argument list
+ * @return Bytes used, the line is truncated to fit and always ends in '\n'
  */
-void logger_log(LogLevel level, const char *format, ...) {
-    if (level < log_level) {
-        return;
+static size_t logger_format(char *buf, size_t size, LogLevel level, const char *format, va_list args) {
+    size_t len = logger_timestamp(buf);
+    int n = snprintf(buf + len, size - len, "[%s] ", logger_level_name(level));
+    len += n > 0 ? (size_t)n : 0;
+    if (len < size) {
+        n = vsnprintf(buf + len, size - len, format, args);
+        len += n > 0 ? (size_t)n : 0;
     }
+    if (len > size - 1) {
+        len = size - 1;
+    }
+    buf[len++] = '\n';
+    return len;
+}
 
-    pthread_mutex_lock(&log_mutex);
+/**
+ * @brief Write all of an iovec array, retrying short writes
+ * @param fd File descriptor
+ * @param iov Lines to write (not modified)
+ * @param count Number of entries in iov
+ */
+static void logger_writev(int fd, const struct iovec *iov, int count) {
+    struct iovec left[LOG_BATCH];
+    memcpy(left, iov, count * sizeof(struct iovec));
 
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    char time_str[20];
-    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", tm_info);
+    struct iovec *cur = left;
+    while (count > 0) {
+        ssize_t n = writev(fd, cur, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        while (count > 0 && (size_t)n >= cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            count--;
+        }
+        if (count > 0) {
+            cur->iov_base = (char *)cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+}
 
-    const char *level_str;
-    switch (level) {
-        case LOG_LEVEL_DEBUG: level_str = "DEBUG"; break;
-        case LOG_LEVEL_INFO:  level_str = "INFO";  break;
-        case LOG_LEVEL_WARN:  level_str = "WARN";  break;
-        case LOG_LEVEL_ERROR: level_str = "ERROR"; break;
-        case LOG_LEVEL_FATAL: level_str = "FATAL"; break;
-        default:              level_str = "UNKNOWN";
+/**
+ * @brief Claim the next free ring slot
+ * @param pos_p Set to the slot's position on success
+ * @return Slot, or NULL if the ring is full
+ */
+static LogSlot *logger_ring_claim(size_t *pos_p) {
+    size_t pos = atomic_load_explicit(&log_async.enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        LogSlot *slot = &log_async.slots[pos & log_async.mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_async.enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *pos_p = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&log_async.enqueue_pos, memory_order_relaxed);
+        }
     }
+}
 
-    va_list args;
-    va_start(args, format);
+/**
+ * @brief Wait until the writer frees a slot and claim it
+ * @param pos_p Set to the slot's position on success
+ * @return Slot, or NULL if async mode is being stopped
+ */
+static LogSlot *logger_ring_wait(size_t *pos_p) {
+    LogSlot *slot;
+
+    // Announce ourselves before the recheck, the writer looks after freeing slots
+    pthread_mutex_lock(&log_async.lock);
+    atomic_fetch_add(&log_async.num_blocked, 1);
+    while ((slot = logger_ring_claim(pos_p)) == NULL && atomic_load(&log_async.running)) {
+        pthread_cond_wait(&log_async.has_space, &log_async.lock);
+    }
+    atomic_fetch_sub(&log_async.num_blocked, 1);
+    pthread_mutex_unlock(&log_async.lock);
+    return slot;
+}
+
+/**
+ * @brief Queue a line for the writer thread
+ * @param level Log level
+ * @param format Format string
+ * @param args Variable argument list
+ * @return 0 if the line was queued or dropped, -1 if the caller must
+ *         write it, async mode is off or was stopped while blocked
+ */
+static int logger_log_async(LogLevel level, const char *format, va_list args) {
+    // Counted before the check so logger_async_stop() can wait for us
+    atomic_fetch_add(&log_async.num_callers, 1);
+    if (!atomic_load(&log_async.running)) {
+        atomic_fetch_sub(&log_async.num_callers, 1);
+        return -1;
+    }
+
+    size_t pos;
+    LogSlot *slot = logger_ring_claim(&pos);
+    if (slot == NULL && log_async.overflow == LOG_OVERFLOW_BLOCK) {
+        slot = logger_ring_wait(&pos);
+        if (slot == NULL) {
+            // Stopped while we waited, blocking never loses a line
+            atomic_fetch_sub(&log_async.num_callers, 1);
+            return -1;
+        }
+    }
+    if (slot == NULL) {
+        atomic_fetch_add_explicit(&log_async.dropped, 1, memory_order_relaxed);
+        atomic_fetch_sub(&log_async.num_callers, 1);
+        return 0;
+    }
+
+    slot->len = logger_format(slot->text, sizeof(slot->text), level, format, args);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    // Publish before looking at the writer, pairs with the recheck in logger_writer()
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&log_async.writer_idle)) {
+        pthread_mutex_lock(&log_async.lock);
+        pthread_cond_signal(&log_async.has_lines);
+        pthread_mutex_unlock(&log_async.lock);
+    }
+    atomic_fetch_sub(&log_async.num_callers, 1);
+    return 0;
+}
+
+/**
+ * @brief Whether the slot at the writer's position holds a finished line
+ * @return 1 if there is a line to write, 0 otherwise
+ */
+static int logger_ring_ready(void) {
+    size_t pos = log_async.dequeue_pos;
+    LogSlot *slot = &log_async.slots[pos & log_async.mask];
+    return atomic_load_explicit(&slot->seq, memory_order_acquire) == pos + 1;
+}
+
+/**
+ * @brief Writer thread, writes finished lines in batches until stopped
+ * @param arg Unused
+ * @return NULL
+ */
+static void *logger_writer(void *arg) {
+    (void)arg;
+    struct iovec iov[LOG_BATCH];
+
+    for (;;) {
+        // Collect the run of finished lines at the head of the ring
+        size_t pos = log_async.dequeue_pos;
+        int count = 0;
+        while (count < LOG_BATCH) {
+            LogSlot *slot = &log_async.slots[(pos + count) & log_async.mask];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + count + 1) {
+                break;
+            }
+            iov[count].iov_base = slot->text;
+            iov[count].iov_len = slot->len;
+            count++;
+        }
+
+        if (count == 0) {
+            pthread_mutex_lock(&log_async.lock);
+            atomic_store(&log_async.writer_idle, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            int stop = log_async.stop;
+            if (!stop && !logger_ring_ready()) {
+                pthread_cond_wait(&log_async.has_lines, &log_async.lock);
+            }
+            atomic_store(&log_async.writer_idle, 0);
+            pthread_mutex_unlock(&log_async.lock);
+            if (stop && !logger_ring_ready()) {
+                break;
+            }
+            continue;
+        }
+
+        if (log_console) {
+            logger_writev(STDERR_FILENO, iov, count);
+        }
+        if (log_file != NULL) {
+            logger_writev(fileno(log_file), iov, count);
+        }
+
+        // Hand the slots back to the callers
+        for (int i = 0; i < count; i++) {
+            LogSlot *slot = &log_async.slots[(pos + i) & log_async.mask];
+            atomic_store_explicit(&slot->seq, pos + i + log_async.mask + 1, memory_order_release);
+        }
+        log_async.dequeue_pos = pos + count;
+
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load(&log_async.num_blocked)) {
+            pthread_mutex_lock(&log_async.lock);
+            pthread_cond_broadcast(&log_async.has_space);
+            pthread_mutex_unlock(&log_async.lock);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Write a line on the calling thread
+ * @param level Log level
+ * @param format Format string
+ * @param args Variable argument list
+ */
+static void logger_log_sync(LogLevel level, const char *format, va_list args) {
+    pthread_mutex_lock(&log_mutex);
+
+    char time_str[LOG_TIME_SIZE];
+    logger_timestamp(time_str);
+
+    const char *level_str = logger_level_name(level);
 
     if (log_console) {
-        fprintf(stderr, "[%s] [%s] ", time_str, level_str);
-        vfprintf(stderr, format, args);
+        va_list console_args;
+        va_copy(console_args, args);
+        fprintf(stderr, "%s[%s] ", time_str, level_str);
+        vfprintf(stderr, format, console_args);
         fprintf(stderr, "\n");
+        va_end(console_args);
     }
 
     if (log_file != NULL) {
-        fprintf(log_file, "[%s] [%s] ", time_str, level_str);
+        fprintf(log_file, "%s[%s] ", time_str, level_str);
         vfprintf(log_file, format, args);
         fprintf(log_file, "\n");
         fflush(log_file);
     }
 
-    va_end(args);
     pthread_mutex_unlock(&log_mutex);
 }
+
+/**
+ * @brief Write all of a buffer, retrying short writes
+ * @param fd File descriptor
+ * @param data Bytes to write
+ * @param len Number of bytes
+ */
+static void logger_write(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/**
+ * @brief Get the time of a binary record
+ *
+ * Same clock as the text timestamp, so only microsecond precision pays
+ * for a full CLOCK_REALTIME read.
+ *
+ * @return Nanoseconds since the epoch
+ */
+static uint64_t logger_bin_now(void) {
+    struct timespec ts;
+    clock_gettime(log_time_precision == LOG_TIME_USEC ? CLOCK_REALTIME : CLOCK_REALTIME_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Give a call site its format id, writing the format to the file
+ *
+ * Runs once per call site. The definition goes straight to the file, so
+ * it is there before any buffered record that uses the id.
+ *
+ * @param site The call site's id
+ * @param format Format string
+ * @return Format id, or -1 if the format can't be logged in binary
+ */
+static int logger_bin_register(_Atomic int *site, const char *format) {
+    pthread_mutex_lock(&log_bin_lock);
+    int id = atomic_load(site);
+    if (id != 0) {
+        pthread_mutex_unlock(&log_bin_lock);
+        return id;
+    }
+
+    id = -1;
+    if (log_bin_num_formats < LOG_BIN_MAX_FORMATS) {
+        LogBinFormat *fmt = &log_bin_formats[log_bin_num_formats];
+        int num_args = 0;
+        int num_values = 0;         // va_list arguments, '*' included
+        const char *p = format;
+        while (*p != '\0' && num_args >= 0) {
+            if (*p++ != '%') {
+                continue;
+            }
+            LogBinSpec spec;
+            p = log_bin_spec(p - 1, &spec);
+            if (spec.kind == LOG_ARG_NONE) {
+                continue;
+            }
+            num_values += spec.num_stars + 1;
+            if (spec.kind == LOG_ARG_TEXT || num_values > LOG_BIN_MAX_ARGS) {
+                num_args = -1;
+                break;
+            }
+            fmt->args[num_args].kind = spec.kind;
+            fmt->args[num_args].num_stars = spec.num_stars;
+            fmt->args[num_args].length = spec.length;
+            num_args++;
+        }
+
+        // Strings get what the stars, numbers and string lengths after them leave
+        int reserve = 0;
+        for (int i = num_args - 1; i >= 0; i--) {
+            fmt->args[i].reserve = (uint16_t)reserve;
+            reserve += fmt->args[i].num_stars * 8 + (fmt->args[i].kind == LOG_ARG_STR ? 2 : 8);
+        }
+
+        size_t len = strlen(format);
+        if (num_args >= 0 && len <= LOG_BIN_MAX_PAYLOAD) {
+            fmt->num_args = num_args;
+            id = ++log_bin_num_formats;
+
+            LogBinRecord record = { LOG_BIN_FORMAT, 0, (uint16_t)len, (uint32_t)id, 0 };
+            uint8_t def[sizeof(record) + LOG_BIN_MAX_PAYLOAD];
+            memcpy(def, &record, sizeof(record));
+            memcpy(def + sizeof(record), format, len);
+            logger_write(atomic_load(&log_bin_fd), def, sizeof(record) + len);
+        }
+    }
+    atomic_store(site, id);
+    pthread_mutex_unlock(&log_bin_lock);
+    return id;
+}
+
+/**
+ * @brief Take a binary buffer from its owner or the flusher
+ * @param buffer Binary buffer
+ */
+static void logger_bin_lock(LogBinBuffer *buffer) {
+    while (atomic_flag_test_and_set_explicit(&buffer->busy, memory_order_acquire)) {
+        sched_yield();
+    }
+}
+
+/**
+ * @brief Release a binary buffer
+ * @param buffer Binary buffer
+ */
+static void logger_bin_unlock(LogBinBuffer *buffer) {
+    atomic_flag_clear_explicit(&buffer->busy, memory_order_release);
+}
+
+/**
+ * @brief Write out a binary buffer, called with it locked
+ * @param buffer Binary buffer
+ */
+static void logger_bin_write(LogBinBuffer *buffer) {
+    if (buffer->len == 0) {
+        return;
+    }
+    logger_write(atomic_load(&log_bin_fd), buffer->data, buffer->len);
+    buffer->len = 0;
+}
+
+/**
+ * @brief Write out the calling thread's binary records
+ */
+void logger_flush(void) {
+    LogBinBuffer *buffer = log_bin_buffer;
+    if (buffer == NULL) {
+        return;
+    }
+    logger_bin_lock(buffer);
+    logger_bin_write(buffer);
+    logger_bin_unlock(buffer);
+}
+
+/**
+ * @brief Thread exit, write out and free the thread's buffer
+ * @param arg The thread's buffer
+ */
+static void logger_bin_exit(void *arg) {
+    LogBinBuffer *buffer = arg;
+
+    // Out of the flusher's reach first, then nobody else can touch it
+    pthread_mutex_lock(&log_bin_list_lock);
+    if (buffer->prev != NULL) {
+        buffer->prev->next = buffer->next;
+    } else {
+        log_bin_buffers = buffer->next;
+    }
+    if (buffer->next != NULL) {
+        buffer->next->prev = buffer->prev;
+    }
+    pthread_mutex_unlock(&log_bin_list_lock);
+
+    logger_bin_write(buffer);
+    log_bin_buffer = NULL;
+    free(buffer);
+}
+
+/**
+ * @brief Flusher thread, writes out buffers of threads that stopped logging
+ *
+ * A thread checks the age of its buffer only when it logs, so an idle
+ * thread would hold on to its last records. A buffer the owner is
+ * appending to is skipped, the owner checks its age itself.
+ *
+ * @param arg Unused
+ * @return NULL
+ */
+static void *logger_bin_flusher(void *arg) {
+    (void)arg;
+    struct timespec ts = { 0, LOG_BIN_FLUSH_NS / 2 };
+
+    for (;;) {
+        nanosleep(&ts, NULL);
+        uint64_t now = logger_bin_now();
+
+        pthread_mutex_lock(&log_bin_list_lock);
+        for (LogBinBuffer *buffer = log_bin_buffers; buffer != NULL; buffer = buffer->next) {
+            if (atomic_flag_test_and_set_explicit(&buffer->busy, memory_order_acquire)) {
+                continue;
+            }
+            if (buffer->len > 0 && now - buffer->first_ns >= LOG_BIN_FLUSH_NS) {
+                logger_bin_write(buffer);
+            }
+            logger_bin_unlock(buffer);
+        }
+        pthread_mutex_unlock(&log_bin_list_lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Record a call as format id plus raw arguments
+ *
+ * Integers and pointers take 8 bytes, doubles 8, strings their length and
+ * characters, so the decoder doesn't depend on this target's type sizes.
+ *
+ * @param site The call site's id
+ * @param level Log level
+ * @param format Format string
+ * @param args Variable argument list
+ * @return 0 if recorded, -1 if the format can't be logged in binary
+ */
+static int logger_log_binary(_Atomic int *site, LogLevel level, const char *format, va_list args) {
+    int id = atomic_load_explicit(site, memory_order_acquire);
+    if (id == 0) {
+        id = logger_bin_register(site, format);
+    }
+    if (id < 0) {
+        return -1;
+    }
+
+    LogBinBuffer *buffer = log_bin_buffer;
+    if (buffer == NULL) {
+        buffer = malloc(sizeof(LogBinBuffer));
+        if (buffer == NULL) {
+            return -1;
+        }
+        atomic_flag_clear(&buffer->busy);
+        buffer->len = 0;
+        buffer->prev = NULL;
+        pthread_mutex_lock(&log_bin_list_lock);
+        buffer->next = log_bin_buffers;
+        if (log_bin_buffers != NULL) {
+            log_bin_buffers->prev = buffer;
+        }
+        log_bin_buffers = buffer;
+        pthread_mutex_unlock(&log_bin_list_lock);
+        log_bin_buffer = buffer;
+        pthread_setspecific(log_bin_key, buffer);
+    }
+
+    logger_bin_lock(buffer);
+    if (buffer->len + sizeof(LogBinRecord) + LOG_BIN_MAX_PAYLOAD > sizeof(buffer->data)) {
+        logger_bin_write(buffer);
+    }
+
+    uint64_t now = logger_bin_now();
+    if (buffer->len == 0) {
+        buffer->first_ns = now;
+    }
+
+    // Arguments go right behind the header, its size is known at the end
+    uint8_t *start = buffer->data + buffer->len;
+    uint8_t *p = start + sizeof(LogBinRecord);
+    uint8_t *end = p + LOG_BIN_MAX_PAYLOAD;
+    const LogBinFormat *fmt = &log_bin_formats[id - 1];
+    for (int i = 0; i < fmt->num_args; i++) {
+        for (int s = 0; s < fmt->args[i].num_stars; s++) {
+            int64_t star = va_arg(args, int);
+            memcpy(p, &star, 8);
+            p += 8;
+        }
+
+        int64_t ival;
+        uint64_t uval;
+        double dval;
+        switch (fmt->args[i].kind) {
+            case LOG_ARG_INT:
+                switch (fmt->args[i].length) {
+                    case 'l': ival = va_arg(args, long); break;
+                    case 'q': ival = va_arg(args, long long); break;
+                    case 'z': ival = va_arg(args, ssize_t); break;
+                    case 'j': ival = va_arg(args, intmax_t); break;
+                    case 't': ival = va_arg(args, ptrdiff_t); break;
+                    default:  ival = va_arg(args, int); break;
+                }
+                memcpy(p, &ival, 8);
+                p += 8;
+                break;
+            case LOG_ARG_UINT:
+                switch (fmt->args[i].length) {
+                    case 'l': uval = va_arg(args, unsigned long); break;
+                    case 'q': uval = va_arg(args, unsigned long long); break;
+                    case 'z': uval = va_arg(args, size_t); break;
+                    case 'j': uval = va_arg(args, uintmax_t); break;
+                    case 't': uval = (size_t)va_arg(args, ptrdiff_t); break;
+                    default:  uval = va_arg(args, unsigned int); break;
+                }
+                memcpy(p, &uval, 8);
+                p += 8;
+                break;
+            case LOG_ARG_DOUBLE:
+                dval = fmt->args[i].length == 'L' ? (double)va_arg(args, long double) : va_arg(args, double);
+                memcpy(p, &dval, 8);
+                p += 8;
+                break;
+            case LOG_ARG_PTR:
+                uval = (uintptr_t)va_arg(args, void *);
+                memcpy(p, &uval, 8);
+                p += 8;
+                break;
+            case LOG_ARG_STR: {
+                const char *str = va_arg(args, const char *);
+                if (str == NULL) {
+                    str = "(null)";
+                }
+                // Leave room for the fixed-size arguments still to come
+                ptrdiff_t room = end - p - 2 - fmt->args[i].reserve;
+                uint16_t len = room > 0 ? (uint16_t)strnlen(str, (size_t)room) : 0;
+                memcpy(p, &len, 2);
+                memcpy(p + 2, str, len);
+                p += 2 + len;
+                break;
+            }
+        }
+    }
+
+    LogBinRecord record = { LOG_BIN_LINE, (uint8_t)level, (uint16_t)(p - start - sizeof(LogBinRecord)), (uint32_t)id, now };
+    memcpy(start, &record, sizeof(record));
+    buffer->len = p - buffer->data;
+
+    // Errors go out at once, everything else when the buffer fills or ages
+    if (level >= LOG_LEVEL_ERROR || now - buffer->first_ns > LOG_BIN_FLUSH_NS) {
+        logger_bin_write(buffer);
+    }
+    logger_bin_unlock(buffer);
+    return 0;
+}
+
+/**
+ * @brief Log a formatted line through the async ring or synchronously
+ * @param level Log level
+ * @param format Format string
+ * @param args Variable argument list
+ */
+static void logger_vlog(LogLevel level, const char *format, va_list args) {
+    if (logger_log_async(level, format, args) == -1) {
+        logger_log_sync(level, format, args);
+    }
+}
+
+/**
+ * @brief Log message
+ * @param level Log level
+ * @param format Format string
+ * @param ... Variable argument list
+ */
+void logger_log(LogLevel level, const char *format, ...) {
+    if (level < log_level) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    logger_vlog(level, format, args);
+    va_end(args);
+}
+
+/**
+ * @brief Log message from a LOG_* call site
+ *
+ * In binary mode the call is recorded under the site's format id,
+ * otherwise it is the same as logger_log(). Formats binary mode can't
+ * record (%n, h/hh integers, wide characters, more than
+ * LOG_BIN_MAX_ARGS arguments) are always logged as text.
+ *
+ * @param site The call site's format id, 0 until first used in binary mode
+ * @param level Log level
+ * @param format Format string, must not change between calls of a site
+ * @param ... Variable argument list
+ */
+void logger_log_site(_Atomic int *site, LogLevel level, const char *format, ...) {
+    if (level < log_level) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    if (atomic_load_explicit(&log_bin_fd, memory_order_relaxed) == -1
+        || logger_log_binary(site, level, format, args) == -1) {
+        va_end(args);
+        va_start(args, format);
+        logger_vlog(level, format, args);
+    }
+    va_end(args);
+}
+
+/**
+ * @brief Switch LOG_* calls to binary records with deferred formatting
+ *
+ * Calls store their format id, time and raw arguments in a per-thread
+ * buffer. It is written out when full, on an ERROR or FATAL, on
+ * logger_flush(), when the thread exits and, by the thread's next call
+ * or a flusher thread, once its oldest record is about a second old.
+ * Use logdecode to turn the file back into text. Binary mode stays on
+ * until the process exits.
+ *
+ * @param filename Binary log file, appended to
+ * @return 0 on success, -1 otherwise
+ */
+int logger_binary_start(const char *filename) {
+    if (atomic_load(&log_bin_fd) != -1) {
+        return -1;
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open binary log file: %s\n", filename);
+        return -1;
+    }
+    if (pthread_key_create(&log_bin_key, logger_bin_exit) != 0) {
+        close(fd);
+        return -1;
+    }
+    pthread_t flusher;
+    if (pthread_create(&flusher, NULL, logger_bin_flusher, NULL) != 0) {
+        fprintf(stderr, "Failed to create binary log flusher thread\n");
+        pthread_key_delete(log_bin_key);
+        close(fd);
+        return -1;
+    }
+    pthread_detach(flusher);
+
+    // Format ids of an earlier run in the same file no longer apply
+    LogBinRecord record = { LOG_BIN_START, 0, 0, LOG_BIN_MAGIC, logger_bin_now() };
+    logger_write(fd, &record, sizeof(record));
+    atomic_store(&log_bin_fd, fd);
+    return 0;
+}
+
+/**
+ * @brief Switch to asynchronous logging
+ *
+ * Callers format into a slot of a lock-free ring and return, a writer
+ * thread writes the lines out in batches with writev. Lines longer than
+ * LOG_SLOT_SIZE are truncated.
+ *
+ * @param slots Ring size, rounded up to a power of two
+ * @param overflow What callers do when the ring is full
+ * @return 0 on success, -1 otherwise
+ */
+int logger_async_start(int slots, LogOverflow overflow) {
+    if (atomic_load(&log_async.running)) {
+        return -1;
+    }
+
+    size_t capacity = 2;
+    while (capacity < (size_t)(slots > 0 ? slots : 1)) {
+        capacity <<= 1;
+    }
+    log_async.slots = malloc(capacity * sizeof(LogSlot));
+    if (log_async.slots == NULL) {
+        fprintf(stderr, "Failed to allocate %zu log slots\n", capacity);
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&log_async.slots[i].seq, i);
+    }
+    log_async.mask = capacity - 1;
+    log_async.overflow = overflow;
+    log_async.stop = 0;
+    log_async.dequeue_pos = 0;
+    atomic_store(&log_async.enqueue_pos, 0);
+    atomic_store(&log_async.writer_idle, 0);
+
+    if (pthread_create(&log_async.thread, NULL, logger_writer, NULL) != 0) {
+        fprintf(stderr, "Failed to create log writer thread\n");
+        free(log_async.slots);
+        log_async.slots = NULL;
+        return -1;
+    }
+    atomic_store(&log_async.running, 1);
+    return 0;
+}
+
+/**
+ * @brief Write out every queued line and go back to synchronous logging
+ *
+ * Also writes out the calling thread's binary records, so one call at
+ * program exit covers both modes.
+ */
+void logger_async_stop(void) {
+    logger_flush();
+    if (!atomic_load(&log_async.running)) {
+        return;
+    }
+
+    // New lines go the synchronous way, blocked callers give up
+    atomic_store(&log_async.running, 0);
+    pthread_mutex_lock(&log_async.lock);
+    pthread_cond_broadcast(&log_async.has_space);
+    pthread_mutex_unlock(&log_async.lock);
+
+    // Callers that got in before finish their line
+    while (atomic_load(&log_async.num_callers)) {
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&log_async.lock);
+    log_async.stop = 1;
+    pthread_cond_signal(&log_async.has_lines);
+    pthread_mutex_unlock(&log_async.lock);
+    pthread_join(log_async.thread, NULL);
+
+    free(log_async.slots);
+    log_async.slots = NULL;
+}
+
+/**
+ * @brief Get the number of lines dropped because the ring was full
+ * @return Dropped lines since the program started
+ */
+unsigned long logger_async_dropped(void) {
+    return atomic_load_explicit(&log_async.dropped, memory_order_relaxed);
+}
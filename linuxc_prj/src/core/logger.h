@@ -10,13 +10,38 @@ typedef enum {
     LOG_LEVEL_FATAL
 } LogLevel;
 
+typedef enum {
+    LOG_OVERFLOW_DROP,      // drop the line and count it
+    LOG_OVERFLOW_BLOCK      // wait for the writer thread to make room
+} LogOverflow;
+
+typedef enum {
+    LOG_TIME_SEC,           // [YYYY-mm-dd HH:MM:SS]
+    LOG_TIME_MSEC,          // [YYYY-mm-dd HH:MM:SS.mmm]
+    LOG_TIME_USEC           // [YYYY-mm-dd HH:MM:SS.uuuuuu]
+} LogTimePrecision;
+
 void logger_init(const char *filename, LogLevel level, int console);
+void logger_set_time_precision(LogTimePrecision precision);
 void logger_log(LogLevel level, const char *format, ...);
+void logger_log_site(_Atomic int *site, LogLevel level, const char *format, ...);
+int logger_binary_start(const char *filename);
+void logger_flush(void);
+
+int logger_async_start(int slots, LogOverflow overflow);
+void logger_async_stop(void);
+unsigned long logger_async_dropped(void);
+
+// Each call site keeps its format id for the binary mode
+#define LOG_AT(level, ...) do {                             \
+        static _Atomic int log_site_ = 0;                   \
+        logger_log_site(&log_site_, (level), __VA_ARGS__);  \
+    } while (0)
 
-#define LOG_DEBUG(...) logger_log(LOG_LEVEL_DEBUG, __VA_ARGS__)
-#define LOG_INFO(...)  logger_log(LOG_LEVEL_INFO,  __VA_ARGS__)
-#define LOG_WARN(...)  logger_log(LOG_LEVEL_WARN,  __VA_ARGS__)
-#define LOG_ERROR(...) logger_log(LOG_LEVEL_ERROR, __VA_ARGS__)
-#define LOG_FATAL(...) logger_log(LOG_LEVEL_FATAL, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO,  __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN,  __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_FATAL(...) LOG_AT(LOG_LEVEL_FATAL, __VA_ARGS__)
 
 #endif // LOGGER_H
@@ -0,0 +1,141 @@
+// src/core/logger_bin.h
+// Binary log layout, shared by logger.c and the host-side logdecode tool
+#ifndef LOGGER_BIN_H
+#define LOGGER_BIN_H
+
+#include <stdint.h>
+#include <string.h>
+
+// START record id, tells the decoder the file's byte order is its own
+#define LOG_BIN_MAGIC 0x4C4F4742u
+
+// Most arguments a binary format may take, '*' widths included
+#define LOG_BIN_MAX_ARGS 16
+
+// Record types
+enum {
+    LOG_BIN_START = 1,      // logger_binary_start(), format ids start over
+    LOG_BIN_FORMAT,         // payload is the format string of id
+    LOG_BIN_LINE            // payload is the raw arguments of one call
+};
+
+// What a conversion takes from the argument list
+enum {
+    LOG_ARG_NONE = 0,       // "%%", nothing
+    LOG_ARG_INT,            // signed integer, 8 bytes
+    LOG_ARG_UINT,           // unsigned integer, 8 bytes
+    LOG_ARG_DOUBLE,         // double, 8 bytes
+    LOG_ARG_PTR,            // pointer value, 8 bytes
+    LOG_ARG_STR,            // 2 byte length, then the characters
+    LOG_ARG_TEXT            // can't be recorded, the format takes the text path
+};
+
+// Record header, followed by size bytes of payload
+typedef struct {
+    uint8_t type;           // LOG_BIN_*
+    uint8_t level;          // LogLevel of a LOG_BIN_LINE
+    uint16_t size;          // payload bytes
+    uint32_t id;            // format id, LOG_BIN_MAGIC for LOG_BIN_START
+    uint64_t time_ns;       // CLOCK_REALTIME of the call
+} LogBinRecord;
+
+// One conversion of a format string
+typedef struct {
+    const char *start;      // the '%'
+    int len;                // bytes up to and including the conversion
+    int mod;                // offset of the length modifier from start
+    char length;            // 0, 'H' (hh), 'h', 'l', 'q' (ll), 'z', 'j', 't' or 'L'
+    char conv;              // conversion character
+    int num_stars;          // '*' width and precision, each an int argument
+    int kind;               // LOG_ARG_*
+} LogBinSpec;
+
+/**
+ * @brief Parse the conversion starting at a '%'
+ * @param p Points at the '%'
+ * @param spec Filled with the conversion
+ * @return First character after the conversion
+ */
+static inline const char *log_bin_spec(const char *p, LogBinSpec *spec) {
+    spec->start = p;
+    spec->num_stars = 0;
+    spec->length = 0;
+    p++;
+
+    while (*p != '\0' && strchr("-+ #0'", *p) != NULL) {
+        p++;
+    }
+    if (*p == '*') {
+        spec->num_stars++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->num_stars++;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+
+    spec->mod = (int)(p - spec->start);
+    if (*p == 'h') {
+        spec->length = p[1] == 'h' ? 'H' : 'h';
+        p += p[1] == 'h' ? 2 : 1;
+    } else if (*p == 'l') {
+        spec->length = p[1] == 'l' ? 'q' : 'l';
+        p += p[1] == 'l' ? 2 : 1;
+    } else if (*p == 'z' || *p == 'j' || *p == 't' || *p == 'L') {
+        spec->length = *p++;
+    }
+
+    spec->conv = *p;
+    switch (*p) {
+        case 'd': case 'i': case 'c':
+            spec->kind = LOG_ARG_INT;
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            spec->kind = LOG_ARG_UINT;
+            break;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            spec->kind = LOG_ARG_DOUBLE;
+            break;
+        case 'p':
+            spec->kind = LOG_ARG_PTR;
+            break;
+        case 's':
+            spec->kind = LOG_ARG_STR;
+            break;
+        case '%':
+            spec->kind = LOG_ARG_NONE;
+            break;
+        default:
+            // %n, %m, positional and unknown conversions
+            spec->kind = LOG_ARG_TEXT;
+            break;
+    }
+
+    // Narrowed integers, %Ld and wide characters would not decode the same
+    if (spec->length == 'h' || spec->length == 'H' || spec->length == 'L') {
+        if (spec->kind == LOG_ARG_INT || spec->kind == LOG_ARG_UINT) {
+            spec->kind = LOG_ARG_TEXT;
+        }
+    } else if (spec->length == 'l' && (spec->conv == 'c' || spec->conv == 's')) {
+        spec->kind = LOG_ARG_TEXT;
+    }
+    if (spec->kind == LOG_ARG_NONE || spec->kind == LOG_ARG_TEXT) {
+        spec->num_stars = 0;
+    }
+    if (*p != '\0') {
+        p++;
+    }
+    spec->len = (int)(p - spec->start);
+    return p;
+}
+
+#endif // LOGGER_BIN_H
@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 200809L
 #endif
@@ -6,13 +9,24 @@
 #endif
 
 #include <unistd.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <sched.h>
+#include <string.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <linux/futex.h>
 
 #include "thread_pool.h"
 
@@ -35,16 +49,84 @@
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 
-static volatile int threads_keepalive;
-static volatile int threads_on_hold;
+/* Default ring size when the config leaves it unset */
+#define THPOOL_RING_DEFAULT_CAPACITY 1024
+
+/* Default number of preallocated job nodes */
+#define THPOOL_SLAB_DEFAULT_SIZE 256
+
+/* Jobs taken ahead of a waiting priority level before it gets a turn */
+#ifndef THPOOL_PRIO_AGING
+#define THPOOL_PRIO_AGING 8
+#endif
+
+/* Default queue wait before an elastic pool adds a worker */
+#define THPOOL_SPAWN_WAIT_DEFAULT_MS 10
+
+/* Default idle time before an elastic pool retires a worker */
+#define THPOOL_IDLE_TIMEOUT_DEFAULT_MS 5000
+
+/* Default number of preallocated future handles */
+#define THPOOL_FUTURE_SLAB_DEFAULT_SIZE 64
+
+/* Slots in each worker's deque, must be a power of two */
+#ifndef THPOOL_DEQUE_CAPACITY
+#define THPOOL_DEQUE_CAPACITY 256
+#endif
+
+/* Timer wheel resolution and geometry, 4 levels of 64 slots span ~4.6 h */
+#define THPOOL_TIMER_TICK_NS 1000000ULL
+#define THPOOL_WHEEL_BITS    6
+#define THPOOL_WHEEL_SIZE    (1 << THPOOL_WHEEL_BITS)
+#define THPOOL_WHEEL_MASK    (THPOOL_WHEEL_SIZE - 1)
+#define THPOOL_WHEEL_LEVELS  4
+
+/* Keep producer and consumer indices on separate cache lines */
+#define THPOOL_CACHELINE 64
+
+/* Default idle spin limit before a worker parks */
+#define THPOOL_SPIN_DEFAULT_US 50
+
+/* Queue checks between clock reads while spinning */
+#define THPOOL_SPIN_CHECKS 32
+
+/* Tasks with their own deadline counters, must be a power of two */
+#define THPOOL_DEADLINE_TASKS 64
+
+/* Default fiber stack, a guard page is added below it */
+#define THPOOL_FIBER_STACK_DEFAULT (64 * 1024)
+
+/* fd events the fiber poller handles per epoll_wait */
+#define THPOOL_FIBER_EVENTS 64
+
+/* Poller retries fibers it could not queue after this long */
+#define THPOOL_FIBER_RETRY_MS 10
+
+/* Pause hint for busy-wait loops */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+
+/* Worker the calling thread runs as, NULL outside any pool */
+static _Thread_local struct thread* thread_self;
+
+/* Fiber the calling thread is running, NULL outside any fiber */
+static _Thread_local struct fiber* fiber_self;
+
+/* Pool whose fiber poller the calling thread is, NULL for other threads */
+static _Thread_local struct thpool_* fiberpoll_self;
 
 /* ========================== STRUCTURES ============================ */
 
-/* Binary semaphore */
+/* Binary semaphore on a futex, bsem_post_n() may stack up several wakeups */
 typedef struct bsem {
-	pthread_mutex_t mutex;
-	pthread_cond_t   cond;
-	int v;
+	atomic_int v;                        /* wakeups left, futex word  */
+	atomic_int num_waiters;              /* threads in FUTEX_WAIT     */
 } bsem;
 
 /* Job */
@@ -52,62 +134,481 @@ typedef struct job{
 	struct job*  prev;                   /* pointer to previous job   */
 	void   (*function)(void* arg);       /* function pointer          */
 	void*  arg;                          /* function's argument       */
+	void   (*done)(void* arg);           /* thpool_poll_completions() */
+	uint64_t queued_ns;                  /* enqueue time, elastic/stats */
+	struct thpool_group_* group;         /* group it counts in, or NULL */
+	struct job*  group_next;             /* group's list of queued jobs */
+	struct job*  group_prev;             /* group's list of queued jobs */
+	int    cancelled;                    /* dropped by thpool_cancel_group */
+	uint64_t deadline_ns;                /* absolute, 0 for none      */
+	void   (*task)(void* arg);           /* deadline counters key     */
+	uint64_t seq;                        /* EDF order on equal deadlines */
+	int    heap_index;                   /* EDF heap slot, -1 outside */
+	int    prio;                         /* EDF heap it was pushed to */
+	_Alignas(max_align_t) unsigned char inline_args[THPOOL_INLINE_ARGS_SIZE]; /* thpool_add_work_inline */
 } job;
 
+/* Preallocated fixed-size nodes with a lock-free freelist
+ *
+ * head packs an ABA tag in the upper 32 bits and index + 1 of the top
+ * free node in the lower 32 bits, 0 meaning the freelist is empty. The
+ * links live beside the nodes so a stale read never touches node data.
+ */
+typedef struct slab{
+	char*        nodes;                  /* node storage              */
+	atomic_uint* links;                  /* index + 1 of next free    */
+	size_t       node_size;              /* bytes per node            */
+	uint32_t     size;                   /* number of nodes           */
+	_Alignas(THPOOL_CACHELINE) atomic_uint_least64_t head;
+} slab;
+
+/* Ring slot, seq tells producers and consumers whose turn it is */
+typedef struct ring_slot{
+	atomic_size_t seq;                   /* slot sequence number      */
+	struct job*   job;                   /* stored job                */
+} ring_slot;
+
+/* Bounded MPMC ring of jobs */
+typedef struct jobring{
+	ring_slot* slots;                    /* slot array                */
+	size_t     mask;                     /* capacity - 1              */
+	_Alignas(THPOOL_CACHELINE) atomic_size_t enqueue_pos;
+	_Alignas(THPOOL_CACHELINE) atomic_size_t dequeue_pos;
+} jobring;
+
+/* Chase-Lev work-stealing deque
+ *
+ * The owner pushes and takes at bottom, thieves steal at top. Bounded,
+ * pushes that don't fit go to the shared job queue instead.
+ */
+typedef struct jobdeque{
+	_Atomic(struct job*) buffer[THPOOL_DEQUE_CAPACITY];
+	_Alignas(THPOOL_CACHELINE) atomic_long top;
+	_Alignas(THPOOL_CACHELINE) atomic_long bottom;
+} jobdeque;
+
+/* Binary min-heap of jobs on (deadline, seq)
+ *
+ * Each job knows its slot, so one can be taken out of the middle.
+ */
+typedef struct jobheap{
+	struct job** jobs;                   /* heap array                */
+	int    len;                          /* jobs in the heap          */
+	int    capacity;                     /* size of jobs, doubles     */
+} jobheap;
+
 /* Job queue */
 typedef struct jobqueue{
+	thpool_queue_type type;              /* backend in use            */
 	pthread_mutex_t rwmutex;             /* used for queue r/w access */
-	job  *front;                         /* pointer to front of queue */
-	job  *rear;                          /* pointer to rear  of queue */
+	job  *front[THPOOL_NUM_PRIO];        /* pointer to front of queue */
+	job  *rear[THPOOL_NUM_PRIO];         /* pointer to rear  of queue */
+	jobring ring[THPOOL_NUM_PRIO];       /* ring backend storage      */
+	jobheap heap[THPOOL_NUM_PRIO];       /* EDF backend storage       */
+	uint64_t seq;                        /* EDF submit order          */
+	slab slab;                           /* job node allocator        */
 	bsem *has_jobs;                      /* flag as binary semaphore  */
-	int   len;                           /* number of jobs in queue   */
+	bsem *has_space;                     /* ring no longer full       */
+	atomic_int len;                      /* number of jobs in queue   */
+	atomic_int len_max;                  /* highest len seen          */
+	atomic_int depth[THPOOL_NUM_PRIO];   /* queued jobs per priority  */
+	atomic_int passed[THPOOL_NUM_PRIO];  /* jobs taken ahead of level */
+	atomic_int num_idle;                 /* workers parked on has_jobs*/
+	atomic_int num_blocked;              /* producers parked on full  */
+	atomic_int closed;                   /* pool going away, no room  */
 } jobqueue;
 
 /* Thread */
+/* Log-linear histogram, written by its worker only */
+typedef struct histogram{
+	atomic_uint_least64_t count;         /* samples                   */
+	atomic_uint_least64_t sum_ns;        /* sum of samples            */
+	atomic_uint_least64_t max_ns;        /* largest sample            */
+	atomic_uint_least64_t buckets[THPOOL_HIST_BUCKETS];
+} histogram;
+
+/* Per worker counters, read by thpool_get_stats() */
+typedef struct thread_stats{
+	histogram wait;                      /* enqueue to start          */
+	histogram run;                       /* start to completion       */
+	atomic_uint_least64_t start_ns;      /* worker started            */
+	atomic_uint_least64_t busy_ns;       /* running jobs since start  */
+} thread_stats;
+
 typedef struct thread{
 	int       id;                        /* friendly id               */
 	pthread_t pthread;                   /* pointer to actual thread  */
 	struct thpool_* thpool_p;            /* access to thpool          */
+	int       active;                    /* slot has a running worker */
+	int       joinable;                  /* pthread not joined yet    */
+	jobdeque  deque;                     /* jobs submitted by itself  */
+	thread_stats stats;                  /* timing, when enabled      */
+	uint64_t  idle_avg_ns;               /* typical wait for a job    */
+	uint64_t  spin_ns;                   /* spin this long, then park */
 } thread;
 
+/* Completion handle of a submitted job */
+typedef struct thpool_future_{
+	struct thpool_* thpool_p;            /* slab it came from         */
+	void*  (*function)(void* arg);       /* function pointer          */
+	void*  arg;                          /* function's argument       */
+	void*  result;                       /* function's return value   */
+	atomic_int done;                     /* result is valid           */
+	atomic_int refs;                     /* caller + pending job      */
+	atomic_int num_waiters;              /* threads blocked on cond   */
+	pthread_mutex_t mutex;               /* used with cond            */
+	pthread_cond_t  cond;                /* signal on completion      */
+} thpool_future_;
+
+/* Jobs waited for and cancelled together
+ *
+ * Queued jobs stay linked in jobs until a worker claims them, so a cancel
+ * only walks the group's own jobs. Cancelled jobs are left in the queue
+ * and freed by whoever pulls them next.
+ */
+typedef struct thpool_group_{
+	struct thpool_* thpool_p;            /* pool the jobs go to       */
+	atomic_int num_pending;              /* queued + running jobs     */
+	atomic_int refs;                     /* owner + jobs in the queue */
+	struct job* jobs;                    /* queued, not yet claimed   */
+	pthread_mutex_t mutex;               /* guards jobs, used with cond */
+	pthread_cond_t  cond;                /* signal when num_pending is 0 */
+} thpool_group_;
+
+/* Range shared by the participants of one thpool_parallel_for() */
+typedef struct parallel_for{
+	void   (*function)(long begin, long end, void* ctx);
+	void*  ctx;                          /* function's context        */
+	long   end;                          /* end of the whole range    */
+	long   grain;                        /* smallest chunk handed out */
+	int    num_workers;                  /* caller + helper jobs      */
+	_Alignas(THPOOL_CACHELINE) atomic_long next;   /* first unclaimed index */
+	_Alignas(THPOOL_CACHELINE) atomic_long num_left; /* indices not yet done */
+	atomic_int refs;                     /* caller + helper jobs      */
+	atomic_int num_waiters;              /* caller blocked on cond    */
+	pthread_mutex_t mutex;               /* used with cond            */
+	pthread_cond_t  cond;                /* signal when num_left is 0 */
+} parallel_for;
+
+/* Node of a task graph, runs once all its predecessors have */
+typedef struct graph_node{
+	struct thpool_graph_* graph_p;       /* graph it belongs to       */
+	void   (*function)(void* arg);       /* function pointer          */
+	void*  arg;                          /* function's argument       */
+	int*   successors;                   /* indices of dependent nodes */
+	int    num_successors;               /* used entries              */
+	int    max_successors;               /* allocated entries         */
+	int    num_predecessors;             /* edges into this node      */
+	atomic_int num_left;                 /* predecessors not done yet */
+} graph_node;
+
+/* Task graph, declared once and run any number of times */
+typedef struct thpool_graph_{
+	struct thpool_* thpool_p;            /* pool the nodes run on     */
+	graph_node* nodes;                   /* all nodes, by index       */
+	int    num_nodes;                    /* used entries              */
+	int    max_nodes;                    /* allocated entries         */
+	int*   roots;                        /* nodes without predecessors */
+	int    num_roots;                    /* valid once sealed         */
+	int    sealed;                       /* checked for cycles        */
+	atomic_int running;                  /* a run is in progress      */
+	atomic_int num_left;                 /* nodes not done this run   */
+	int    finished;                     /* last node done, by mutex  */
+	pthread_mutex_t mutex;               /* used with cond            */
+	pthread_cond_t  cond;                /* signal when a run is done */
+} thpool_graph_;
+
+/* Delayed or periodic job */
+typedef struct thpool_timer_{
+	struct thpool_* thpool_p;            /* pool the job goes to      */
+	void   (*function)(void* arg);       /* function pointer          */
+	void*  arg;                          /* function's argument       */
+	uint64_t expires;                    /* tick of the next run      */
+	uint64_t period;                     /* ticks between runs, or 0  */
+	struct thpool_timer_* next;          /* wheel slot list           */
+	struct thpool_timer_* prev;          /* wheel slot list           */
+	struct thpool_timer_** slot;         /* head of the slot list     */
+	struct thpool_timer_* fire_next;     /* expired in this tick      */
+	uint64_t fire_deadline_ns;           /* EDF deadline of that run  */
+	int    queued;                       /* linked into the wheel     */
+	atomic_int refs;                     /* caller + wheel + job      */
+	atomic_int cancelled;                /* set by thpool_timer_cancel */
+	atomic_int running;                  /* a periodic run is queued  */
+} thpool_timer_;
+
+/* Why a fiber switched back to its worker */
+typedef enum {
+	FIBER_RUNNING = 0,
+	FIBER_YIELD,                         /* queue it again right away */
+	FIBER_SLEEP,                         /* queue it when park_ms are up */
+	FIBER_WAIT_FD,                       /* queue it when park_fd is ready */
+	FIBER_DONE                           /* function returned, free it */
+} fiber_park;
+
+/* Stackful task, runs on whichever worker picks up its job */
+typedef struct fiber{
+	struct thpool_* thpool_p;            /* pool it runs on           */
+	void   (*function)(void* arg);       /* function pointer          */
+	void*  arg;                          /* function's argument       */
+	ucontext_t context;                  /* the fiber's own registers */
+	ucontext_t caller;                   /* worker it was resumed from */
+	char*  stack;                        /* mapping, guard page first */
+	size_t stack_size;                   /* bytes mapped              */
+	fiber_park park;                     /* why it switched out       */
+	int    park_ms;                      /* FIBER_SLEEP               */
+	int    park_fd;                      /* FIBER_WAIT_FD             */
+	int    park_events;                  /* FIBER_WAIT_FD             */
+	int    revents;                      /* park_fd events, -1 if parking failed */
+	struct fiber* next;                  /* pool's list of live fibers */
+	struct fiber* prev;                  /* pool's list of live fibers */
+	struct fiber* pending_next;          /* poller's fibers to queue again */
+} fiber;
+
+/* Live fibers of a pool and the thread waiting on their fds */
+typedef struct fiberpoll{
+	pthread_mutex_t lock;                /* guards everything below   */
+	fiber*     fibers;                   /* freed with the pool       */
+	pthread_t  thread;                   /* waits on epfd             */
+	int        started;                  /* thread and fds exist      */
+	int        stopped;                  /* pool is going away        */
+	int        epfd;                     /* fds fibers wait on        */
+	int        stopfd;                   /* eventfd, stops the thread */
+} fiberpoll;
+
+/* Hierarchical timer wheel, level n slots are 64^n ticks wide */
+typedef struct timerwheel{
+	pthread_mutex_t lock;                /* guards everything below   */
+	pthread_t  thread;                   /* dispatches expired timers */
+	int        started;                  /* thread and fd exist       */
+	int        fd;                       /* timerfd the thread reads  */
+	int        stop;                     /* ask the thread to exit    */
+	uint64_t   base_ns;                  /* monotonic time of tick 0  */
+	uint64_t   now;                      /* last processed tick       */
+	uint64_t   armed;                    /* tick fd fires at, or 0    */
+	int        num_timers;               /* timers linked in slots    */
+	thpool_timer_* slots[THPOOL_WHEEL_LEVELS][THPOOL_WHEEL_SIZE];
+} timerwheel;
+
+/* Deadline counters of one task, the key is claimed once and kept */
+typedef struct deadline_task{
+	atomic_uintptr_t function;           /* task function, 0 if free  */
+	atomic_uint_least64_t num_runs;      /* runs with a deadline      */
+	atomic_uint_least64_t num_missed;    /* runs that finished late   */
+	atomic_uint_least64_t max_late_ns;   /* worst overrun             */
+} deadline_task;
+
 /* Threadpool */
 typedef struct thpool_{
 	thread**   threads;                  /* pointer to threads        */
-	volatile int num_threads_alive;      /* threads currently alive   */
-	volatile int num_threads_working;    /* threads currently working */
+	int        num_threads;              /* size of threads, max size */
+	int        min_threads;              /* workers kept while idle   */
+	int        num_threads_active;       /* slots with a worker       */
+	int        num_threads_alive;        /* threads currently alive   */
+	atomic_int num_threads_working;      /* threads currently working */
+	thpool_group_ all;                   /* every job, for thpool_wait */
+	atomic_int keepalive;                /* workers exit once cleared */
+	atomic_int on_hold;                  /* pending thpool_pause calls */
+	pthread_mutex_t hold_lock;           /* used with hold_cond       */
+	pthread_cond_t  hold_cond;           /* pause and resume handoff  */
+	uint64_t   spawn_wait_ns;            /* queue wait that adds one  */
+	int        idle_timeout_ms;          /* idle time that retires one */
+	uint64_t   last_spawn_ns;            /* rate limits growing       */
+	atomic_uint_least64_t last_take_ns;  /* last time a job was taken */
+	char       name[16];                 /* worker thread name prefix */
+	unsigned long cpu_mask;              /* worker CPUs, 0 inherits   */
+	int        sched_policy;             /* worker scheduling policy  */
+	int        sched_priority;           /* priority for FIFO and RR  */
+	int        stats;                    /* stamp and time jobs       */
+	uint64_t   spin_max_ns;              /* idle spin limit, 0 parks  */
+	int        queue_limit;              /* queued jobs, 0 unbounded  */
+	thpool_overflow overflow;            /* what to do when full      */
+	int        block_timeout_ms;         /* THPOOL_OVERFLOW_BLOCK     */
+	atomic_uint_least64_t num_blocked;   /* producers that had to wait */
+	atomic_uint_least64_t num_timed_out; /* jobs refused after waiting */
+	atomic_uint_least64_t num_rejected;  /* jobs refused right away   */
+	atomic_uint_least64_t num_dropped;   /* old jobs thrown away      */
+	atomic_uint_least64_t num_caller_ran; /* jobs run by the producer */
+	atomic_uint_least64_t num_deadline_missed; /* late deadline jobs */
+	deadline_task deadlines[THPOOL_DEADLINE_TASKS]; /* per task, open addressing */
 	pthread_mutex_t  thcount_lock;       /* used for thread count etc */
-	pthread_cond_t  threads_all_idle;    /* signal to thpool_wait     */
+	pthread_cond_t  threads_started;     /* signal to thpool_init     */
 	jobqueue  jobqueue;                  /* job queue                 */
+	_Atomic(struct job*) completions;    /* finished jobs with a done */
+	atomic_int completion_fd;            /* eventfd, -1 until asked for */
+	slab      future_slab;               /* future handle allocator   */
+	timerwheel timers;                   /* delayed and periodic jobs */
+	fiberpoll fibers;                    /* fibers and their fd waits */
 } thpool_;
 
 /* ========================== PROTOTYPES ============================ */
 static int  thread_init(thpool_* thpool_p, struct thread** thread_p, int id);
+static int   thread_start(struct thread* thread_p);
+static void  thread_grow(thpool_* thpool_p, uint64_t now_ns);
+static int   thread_retire(struct thread* thread_p);
 static void* thread_do(struct thread* thread_p);
-static void  thread_hold(int sig_id);
+static struct job* thread_next_job(struct thread* thread_p);
+static void  thread_run_job(thpool_* thpool_p, struct job* job_p);
+static int   thread_spin(struct thread* thread_p, uint64_t idle_ns);
+static void  thread_spin_update(struct thread* thread_p, uint64_t idle_ns);
+
+static int   thpool_push_jobs(thpool_* thpool_p, struct job* first_p, struct job* last_p, int num_jobs, int prio);
+static int   thpool_admit(thpool_* thpool_p, struct job* first_p, int num_jobs, int is_worker);
+static int   thpool_has_room(thpool_* thpool_p, int num_jobs);
+static int   thpool_drop_oldest(thpool_* thpool_p, int num_jobs, int is_worker);
+static int   thpool_job_droppable(const struct job* job_p);
+static int   thpool_job_discard(thpool_* thpool_p, struct job* job_p);
+static void  thpool_job_discard_chain(thpool_* thpool_p, struct job* first_p);
+static int   thpool_push_deadline(thpool_* thpool_p, void (*function_p)(void*), void* arg_p, uint64_t deadline_ns, void (*task_p)(void*));
+static void  thpool_job_complete(thpool_* thpool_p, struct job* job_p);
+
+static void  parallel_for_run(void* pf_p);
+static void  parallel_for_work(parallel_for* pf_p);
+static void  parallel_for_put(parallel_for* pf_p);
+
+static void  future_run(void* future_p);
+static void  future_put(thpool_future_* future_p);
+static void  future_sync_init(thpool_future_* future_p);
+static void  future_sync_destroy(thpool_future_* future_p);
+
+static int   graph_seal(thpool_graph_* graph_p);
+static void  graph_node_run(void* node_p);
+static graph_node* graph_release(graph_node* node_p);
+
+static void  group_init(thpool_group_* group_p, thpool_* thpool_p);
+static void  group_attach(thpool_group_* group_p, struct job* job_p);
+static int   group_claim(thpool_group_* group_p, struct job* job_p);
+static void  group_done(thpool_group_* group_p, int num_jobs);
+static void  group_wait(thpool_group_* group_p);
+static void  group_put(thpool_group_* group_p);
+static void  group_destroy(thpool_group_* group_p);
+static void  thread_hold(thpool_* thpool_p);
+static void  thread_setup(struct thread* thread_p);
+
+static void  histogram_add(histogram* histogram_p, uint64_t value_ns);
+static void  histogram_read(const histogram* histogram_p, thpool_histogram* out_p);
+static void  counter_add(atomic_uint_least64_t* counter_p, uint64_t value);
+static void  deadline_account(thpool_* thpool_p, void (*task_p)(void*), uint64_t deadline_ns, uint64_t done_ns);
+static deadline_task* deadline_lookup(thpool_* thpool_p, void (*task_p)(void*), int create);
 static void  thread_destroy(struct thread* thread_p);
 
-static int   jobqueue_init(jobqueue* jobqueue_p);
+static void  timerwheel_init(timerwheel* wheel_p);
+static int   timerwheel_start(thpool_* thpool_p);
+static void  timerwheel_add(timerwheel* wheel_p, thpool_timer_* timer_p);
+static void  timerwheel_remove(timerwheel* wheel_p, thpool_timer_* timer_p);
+static void  timerwheel_arm(timerwheel* wheel_p, uint64_t tick);
+static uint64_t timerwheel_next(timerwheel* wheel_p);
+static uint64_t timerwheel_tick(timerwheel* wheel_p);
+static void* timerwheel_do(thpool_* thpool_p);
+static void  timerwheel_destroy(timerwheel* wheel_p);
+static thpool_timer_* timer_schedule(thpool_* thpool_p, int delay_ms, int period_ms, void (*function_p)(void*), void* arg_p);
+static void  timer_run(void* timer_p);
+static void  timer_put(thpool_timer_* timer_p);
+
+static void  fiber_main(void);
+static void  fiber_run(void* fiber_p);
+static void  fiber_switch(fiber* fiber_p, fiber_park park);
+static int   fiber_park_done(fiber* fiber_p);
+static void  fiber_free(fiber* fiber_p);
+static void  fiberpoll_init(fiberpoll* poll_p);
+static int   fiberpoll_start(thpool_* thpool_p);
+static int   fiberpoll_add(thpool_* thpool_p, fiber* fiber_p);
+static void* fiberpoll_do(thpool_* thpool_p);
+static void  fiberpoll_resume(thpool_* thpool_p, fiber* fiber_p, fiber** pending_p);
+static void  fiberpoll_stop(fiberpoll* poll_p);
+static void  fiberpoll_destroy(fiberpoll* poll_p);
+
+static void  job_init(struct job* job_p, void (*function_p)(void*), void* arg_p, int prio);
+static int   jobqueue_init(jobqueue* jobqueue_p, const thpool_config* config);
 static void  jobqueue_clear(jobqueue* jobqueue_p);
-static void  jobqueue_push(jobqueue* jobqueue_p, struct job* newjob_p);
-static struct job* jobqueue_pull(jobqueue* jobqueue_p);
+static struct job* jobqueue_pull(jobqueue* jobqueue_p, int high_only);
+static struct job* jobqueue_pull_level(jobqueue* jobqueue_p, int prio);
+static struct job* jobqueue_pull_oldest(jobqueue* jobqueue_p, int prio, int (*droppable)(const struct job*));
+static struct job* jobqueue_push_chain(jobqueue* jobqueue_p, struct job* first_p, struct job* last_p, int num_jobs, int prio, int may_block);
+static void  jobqueue_published(jobqueue* jobqueue_p, int prio, int num_jobs);
+static void  jobqueue_taken(jobqueue* jobqueue_p, int prio);
+static int   jobqueue_park(jobqueue* jobqueue_p, atomic_int* keepalive, int timeout_ms);
+static void  jobqueue_close(jobqueue* jobqueue_p);
 static void  jobqueue_destroy(jobqueue* jobqueue_p);
 
+static int   jobring_init(jobring* jobring_p, int capacity);
+static int   jobring_push(jobring* jobring_p, struct job* newjob_p);
+static struct job* jobring_pull(jobring* jobring_p);
+static void  jobring_destroy(jobring* jobring_p);
+
+static int   jobheap_init(jobheap* jobheap_p, int capacity);
+static int   jobheap_push(jobheap* jobheap_p, struct job* newjob_p);
+static struct job* jobheap_pop(jobheap* jobheap_p);
+static struct job* jobheap_pop_oldest(jobheap* jobheap_p, int (*droppable)(const struct job*));
+static void  jobheap_remove(jobheap* jobheap_p, struct job* job_p);
+static int   jobheap_before(const struct job* a_p, const struct job* b_p);
+static void  jobheap_up(jobheap* jobheap_p, int index);
+static void  jobheap_down(jobheap* jobheap_p, int index);
+static void  jobheap_destroy(jobheap* jobheap_p);
+
+static void  jobdeque_init(jobdeque* jobdeque_p);
+static int   jobdeque_push(jobdeque* jobdeque_p, struct job* newjob_p);
+static struct job* jobdeque_take(jobdeque* jobdeque_p);
+static struct job* jobdeque_steal(jobdeque* jobdeque_p);
+
+static int   slab_init(slab* slab_p, size_t node_size, int size);
+static void* slab_alloc(slab* slab_p);
+static void  slab_free(slab* slab_p, void* node_p);
+static int   slab_owns(slab* slab_p, void* node_p);
+static void* slab_node(slab* slab_p, uint32_t index);
+static void  slab_destroy(slab* slab_p);
+
 static void  bsem_init(struct bsem *bsem_p, int value);
 static void  bsem_reset(struct bsem *bsem_p);
 static void  bsem_post(struct bsem *bsem_p);
-static void  bsem_post_all(struct bsem *bsem_p);
+static void  bsem_post_n(struct bsem *bsem_p, int n);
 static void  bsem_wait(struct bsem *bsem_p);
+static int   bsem_wait_timeout(struct bsem *bsem_p, int timeout_ms);
+
+static int   bsem_take(struct bsem *bsem_p);
+static long  futex(atomic_int* uaddr, int op, int val, const struct timespec* timeout);
+
+static void  deadline_after(struct timespec* deadline, int timeout_ms);
+static uint64_t clock_now_ns(void);
 
 /* ========================== THREADPOOL ============================ */
+/* Fill config with defaults */
+void thpool_config_init(thpool_config* config){
+	config->num_threads      = 1;
+	config->max_threads      = 0;
+	config->spawn_wait_ms    = THPOOL_SPAWN_WAIT_DEFAULT_MS;
+	config->idle_timeout_ms  = THPOOL_IDLE_TIMEOUT_DEFAULT_MS;
+	config->queue_type       = THPOOL_QUEUE_LIST;
+	config->queue_capacity   = THPOOL_RING_DEFAULT_CAPACITY;
+	config->job_slab_size    = THPOOL_SLAB_DEFAULT_SIZE;
+	config->future_slab_size = THPOOL_FUTURE_SLAB_DEFAULT_SIZE;
+	config->name             = NULL;
+	config->cpu_mask         = 0;
+	config->sched_policy     = SCHED_OTHER;
+	config->sched_priority   = 0;
+	config->stats            = 0;
+	config->queue_limit      = 0;
+	config->overflow         = THPOOL_OVERFLOW_BLOCK;
+	config->block_timeout_ms = 0;
+	config->spin_us          = THPOOL_SPIN_DEFAULT_US;
+}
+
 /* Initialise thread pool */
 struct thpool_* thpool_init(int num_threads){
+	thpool_config config;
+	thpool_config_init(&config);
+	config.num_threads = num_threads;
+	return thpool_init_ex(&config);
+}
 
-	threads_on_hold   = 0;
-	threads_keepalive = 1;
+/* Initialise thread pool with explicit parameters */
+struct thpool_* thpool_init_ex(const thpool_config* config){
 
+	int num_threads = config->num_threads;
 	if (num_threads < 0){
 		num_threads = 0;
 	}
+	/* Slots for the largest size the pool may grow to */
+	int max_threads = config->max_threads > num_threads ? config->max_threads : num_threads;
 
 	/* Make new thread pool */
 	thpool_* thpool_p;
@@ -117,331 +618,3586 @@ struct thpool_* thpool_init(int num_threads){
 		return NULL;
 	}
 	thpool_p->num_threads_alive   = 0;
-	thpool_p->num_threads_working = 0;
+	atomic_init(&thpool_p->num_threads_working, 0);
+	atomic_init(&thpool_p->keepalive, 1);
+	atomic_init(&thpool_p->on_hold, 0);
+
+	/* Worker placement, applied by each worker to itself */
+	snprintf(thpool_p->name, sizeof(thpool_p->name), "%s",
+	         config->name != NULL && config->name[0] ? config->name : TOSTRING(THPOOL_THREAD_NAME));
+	thpool_p->cpu_mask       = config->cpu_mask;
+	thpool_p->sched_policy   = config->sched_policy;
+	thpool_p->sched_priority = config->sched_priority;
+	thpool_p->stats          = config->stats;
+
+	/* Spinning only pays off with another CPU to produce the job */
+	thpool_p->spin_max_ns = config->spin_us > 0 && sysconf(_SC_NPROCESSORS_ONLN) > 1
+	                      ? (uint64_t)config->spin_us * 1000ULL : 0;
+
+	/* Bounded queue */
+	thpool_p->queue_limit      = config->queue_limit > 0 ? config->queue_limit : 0;
+	thpool_p->overflow         = config->overflow;
+	thpool_p->block_timeout_ms = config->block_timeout_ms > 0 ? config->block_timeout_ms : 0;
+	atomic_init(&thpool_p->num_blocked, 0);
+	atomic_init(&thpool_p->num_timed_out, 0);
+	atomic_init(&thpool_p->num_rejected, 0);
+	atomic_init(&thpool_p->num_dropped, 0);
+	atomic_init(&thpool_p->num_caller_ran, 0);
+
+	/* Deadline counters, tasks claim an entry on their first run */
+	atomic_init(&thpool_p->num_deadline_missed, 0);
+	int t;
+	for (t=0; t<THPOOL_DEADLINE_TASKS; t++){
+		atomic_init(&thpool_p->deadlines[t].function, 0);
+		atomic_init(&thpool_p->deadlines[t].num_runs, 0);
+		atomic_init(&thpool_p->deadlines[t].num_missed, 0);
+		atomic_init(&thpool_p->deadlines[t].max_late_ns, 0);
+	}
+
+	/* Growing and shrinking, only when max_threads is above num_threads */
+	thpool_p->spawn_wait_ns   = (uint64_t)(config->spawn_wait_ms > 0 ? config->spawn_wait_ms : 0) * 1000000ULL;
+	thpool_p->idle_timeout_ms = config->idle_timeout_ms > 0 ? config->idle_timeout_ms : 0;
+	thpool_p->last_spawn_ns   = 0;
+	atomic_init(&thpool_p->last_take_ns, clock_now_ns());
+
+	/* Completion notification, the eventfd is made on first use */
+	atomic_init(&thpool_p->completions, NULL);
+	atomic_init(&thpool_p->completion_fd, -1);
 
 	/* Initialise the job queue */
-	if (jobqueue_init(&thpool_p->jobqueue) == -1){
+	if (jobqueue_init(&thpool_p->jobqueue, config) == -1){
 		err("thpool_init(): Could not allocate memory for job queue\n");
 		free(thpool_p);
 		return NULL;
 	}
 
+	/* Preallocate future handles */
+	if (slab_init(&thpool_p->future_slab, sizeof(struct thpool_future_), config->future_slab_size) == -1){
+		err("thpool_init(): Could not allocate memory for futures\n");
+		jobqueue_destroy(&thpool_p->jobqueue);
+		free(thpool_p);
+		return NULL;
+	}
+	uint32_t slot;
+	for (slot=0; slot<thpool_p->future_slab.size; slot++){
+		future_sync_init((struct thpool_future_*)slab_node(&thpool_p->future_slab, slot));
+	}
+
 	/* Make threads in pool */
-	thpool_p->threads = (struct thread**)malloc(num_threads * sizeof(struct thread *));
+	thpool_p->threads = (struct thread**)malloc(max_threads * sizeof(struct thread *));
 	if (thpool_p->threads == NULL){
 		err("thpool_init(): Could not allocate memory for threads\n");
+		for (slot=0; slot<thpool_p->future_slab.size; slot++){
+			future_sync_destroy((struct thpool_future_*)slab_node(&thpool_p->future_slab, slot));
+		}
+		slab_destroy(&thpool_p->future_slab);
 		jobqueue_destroy(&thpool_p->jobqueue);
 		free(thpool_p);
 		return NULL;
 	}
 
 	pthread_mutex_init(&(thpool_p->thcount_lock), NULL);
-	pthread_cond_init(&thpool_p->threads_all_idle, NULL);
+	group_init(&thpool_p->all, thpool_p);
+	pthread_cond_init(&thpool_p->threads_started, NULL);
+	pthread_mutex_init(&thpool_p->hold_lock, NULL);
+	pthread_cond_init(&thpool_p->hold_cond, NULL);
+	timerwheel_init(&thpool_p->timers);
+	fiberpoll_init(&thpool_p->fibers);
 
-	/* Thread init */
+	/* Thread init, every deque exists before any worker may steal */
 	int n;
+	for (n=0; n<max_threads; n++){
+		if (thread_init(thpool_p, &thpool_p->threads[n], n) == -1){
+			max_threads = n;
+			break;
+		}
+	}
+	if (num_threads > max_threads){
+		num_threads = max_threads;
+	}
+	thpool_p->num_threads        = max_threads;
+	thpool_p->min_threads        = num_threads;
+	thpool_p->num_threads_active = 0;
 	for (n=0; n<num_threads; n++){
-		thread_init(thpool_p, &thpool_p->threads[n], n);
+		thpool_p->threads[n]->active = 1;
+		if (thread_start(thpool_p->threads[n]) == -1){
+			thpool_p->threads[n]->active = 0;
+			num_threads = n;
+			pthread_mutex_lock(&thpool_p->thcount_lock);
+			thpool_p->min_threads = n;
+			pthread_mutex_unlock(&thpool_p->thcount_lock);
+			break;
+		}
+		thpool_p->num_threads_active++;
 #if THPOOL_DEBUG
 			printf("THPOOL_DEBUG: Created thread %d in pool \n", n);
 #endif
 	}
 
-	/* Wait for threads to initialize */
-	while (thpool_p->num_threads_alive != num_threads) {}
+	/* Wait for threads to initialize, each one checks in once */
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	while (thpool_p->num_threads_alive < num_threads){
+		pthread_cond_wait(&thpool_p->threads_started, &thpool_p->thcount_lock);
+	}
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
 
 	return thpool_p;
 }
 
 
-/* Add work to the thread pool */
-int thpool_add_work(thpool_* thpool_p, void (*function_p)(void*), void* arg_p){
-	job* newjob;
+/* Queue a chain of jobs linked through prev
+ *
+ * Normal priority jobs submitted from one of our own workers fill its
+ * deque first so they stay local and others steal them, except in an EDF
+ * pool where every job has to go through the heap. A worker never blocks on a full ring,
+ * since it may be the one that has to drain it; it runs the jobs that don't
+ * fit itself instead.
+ */
+static int thpool_push_jobs(thpool_* thpool_p, struct job* first, struct job* last, int num_jobs, int prio){
+	int is_worker = thread_self != NULL && thread_self->thpool_p == thpool_p;
 
-	newjob=(struct job*)malloc(sizeof(struct job));
-	if (newjob==NULL){
-		err("thpool_add_work(): Could not allocate memory for new job\n");
+	atomic_fetch_add(&thpool_p->all.num_pending, num_jobs);
+
+	/* Grouped jobs go on their group's books before any worker sees them,
+	 * and after the pool's so a cancel can't take the count below zero */
+	job* grouped;
+	for (grouped = first; grouped != NULL; grouped = grouped->prev){
+		if (grouped->group != NULL){
+			group_attach(grouped->group, grouped);
+		}
+	}
+
+	/* Bounded queue full -> overflow policy. Fibers the poller wakes were
+	 * admitted when spawned, and must never run on the poller itself */
+	int admit = thpool_p->queue_limit > 0 && fiberpoll_self != thpool_p
+	          ? thpool_admit(thpool_p, first, num_jobs, is_worker) : 0;
+	if (admit == -1){
 		return -1;
 	}
 
-	/* add function and argument */
-	newjob->function=function_p;
-	newjob->arg=arg_p;
+	if (admit == 1){
+		while (first != NULL){
+			job* next = first->prev;
+			thread_run_job(thpool_p, first);
+			first = next;
+		}
+		return 0;
+	}
+
+	/* Stamp the jobs for stats and the elastic pool */
+	int elastic = thpool_p->num_threads > thpool_p->min_threads;
+	if (elastic || thpool_p->stats){
+		uint64_t now = clock_now_ns();
+		job* job_p = first;
+		int n;
+		for (n=0; n<num_jobs; n++){
+			job_p->queued_ns = now;
+			job_p = job_p->prev;
+		}
+
+		/* Grow if nobody took a job lately */
+		if (elastic && atomic_load(&thpool_p->jobqueue.num_idle) == 0
+		    && now - atomic_load_explicit(&thpool_p->last_take_ns, memory_order_relaxed) > thpool_p->spawn_wait_ns){
+			thread_grow(thpool_p, now);
+		}
+	}
 
-	/* add job to queue */
-	jobqueue_push(&thpool_p->jobqueue, newjob);
+	if (is_worker && prio == THPOOL_PRIO_NORMAL && thpool_p->jobqueue.type != THPOOL_QUEUE_EDF){
+		int num_local = 0;
+		while (first != NULL){
+			/* Read the link first, the job may be stolen as soon as it is in */
+			job* next = first->prev;
+			if (jobdeque_push(&thread_self->deque, first) == -1){
+				break;
+			}
+			first = next;
+			num_local++;
+		}
+		jobqueue_published(&thpool_p->jobqueue, THPOOL_PRIO_NORMAL, num_local);
+		num_jobs -= num_local;
+		if (first == NULL){
+			return 0;
+		}
+	}
 
+	/* add jobs to queue */
+	job* job_p = jobqueue_push_chain(&thpool_p->jobqueue, first, last, num_jobs, prio, !is_worker);
+	if (job_p != NULL && !is_worker && thpool_p->jobqueue.type == THPOOL_QUEUE_RING){
+		/* Ring closed under us, still counted as blocked until the rest is gone */
+		while (job_p != NULL){
+			job* next = job_p->prev;
+			thpool_job_discard(thpool_p, job_p);
+			job_p = next;
+		}
+		atomic_fetch_sub(&thpool_p->jobqueue.num_blocked, 1);
+		return -1;
+	}
+	while (job_p != NULL){
+		job* next = job_p->prev;
+		thread_run_job(thpool_p, job_p);
+		job_p = next;
+	}
 	return 0;
 }
 
-/* Wait until all jobs have finished */
-void thpool_wait(thpool_* thpool_p){
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	while (thpool_p->jobqueue.len || thpool_p->num_threads_working) {
-		pthread_cond_wait(&thpool_p->threads_all_idle, &thpool_p->thcount_lock);
+/* Apply the overflow policy when a bounded queue has no room
+ *
+ * A worker is never blocked, it may be the one that has to make room,
+ * so THPOOL_OVERFLOW_BLOCK runs its jobs in place instead, as does
+ * THPOOL_OVERFLOW_DROP_OLDEST when nothing left in the queue may be
+ * dropped. Other producers are refused in that case. Concurrent
+ * producers check the limit independently and may overshoot it by one
+ * batch each. A blocked producer is refused once thpool_destroy() closes
+ * the queue, it stays counted in num_blocked until its jobs are gone so
+ * the pool isn't freed under it.
+ *
+ * @return 0 to queue the jobs, 1 to run them in the caller, -1 if they
+ *         were refused and discarded
+ */
+static int thpool_admit(thpool_* thpool_p, struct job* first, int num_jobs, int is_worker){
+	if (thpool_has_room(thpool_p, num_jobs)){
+		return 0;
 	}
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
-}
 
-/* Destroy the threadpool */
-void thpool_destroy(thpool_* thpool_p){
-	/* No need to destroy if it's NULL */
-	if (thpool_p == NULL) return ;
+	jobqueue* jobqueue_p = &thpool_p->jobqueue;
+	thpool_overflow overflow = thpool_p->overflow;
+	if (overflow == THPOOL_OVERFLOW_BLOCK && is_worker){
+		overflow = THPOOL_OVERFLOW_CALLER_RUNS;
+	}
 
-	volatile int threads_total = thpool_p->num_threads_alive;
+	switch (overflow){
+	case THPOOL_OVERFLOW_REJECT:
+		atomic_fetch_add_explicit(&thpool_p->num_rejected, num_jobs, memory_order_relaxed);
+		thpool_job_discard_chain(thpool_p, first);
+		return -1;
 
-	/* End each thread 's infinite loop */
-	threads_keepalive = 0;
+	case THPOOL_OVERFLOW_CALLER_RUNS:
+		atomic_fetch_add_explicit(&thpool_p->num_caller_ran, num_jobs, memory_order_relaxed);
+		return 1;
 
-	/* Give one second to kill idle threads */
-	double TIMEOUT = 1.0;
-	time_t start, end;
-	double tpassed = 0.0;
-	time (&start);
-	while (tpassed < TIMEOUT && thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue.has_jobs);
-		time (&end);
-		tpassed = difftime(end,start);
-	}
+	case THPOOL_OVERFLOW_DROP_OLDEST:
+		if (thpool_drop_oldest(thpool_p, atomic_load(&jobqueue_p->len) + num_jobs - thpool_p->queue_limit, is_worker) == 0){
+			return 0;
+		}
+		/* Only jobs somebody waits on are left, fall back to REJECT */
+		if (is_worker){
+			atomic_fetch_add_explicit(&thpool_p->num_caller_ran, num_jobs, memory_order_relaxed);
+			return 1;
+		}
+		atomic_fetch_add_explicit(&thpool_p->num_rejected, num_jobs, memory_order_relaxed);
+		thpool_job_discard_chain(thpool_p, first);
+		return -1;
 
-	/* Poll remaining threads */
-	while (thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue.has_jobs);
-		sleep(1);
+	default:
+		break;
 	}
 
-	/* Job queue cleanup */
-	jobqueue_destroy(&thpool_p->jobqueue);
-	/* Deallocs */
-	int n;
-	for (n=0; n < threads_total; n++){
-		thread_destroy(thpool_p->threads[n]);
+	/* Block until workers make room, announce ourselves before the recheck */
+	atomic_fetch_add_explicit(&thpool_p->num_blocked, 1, memory_order_relaxed);
+	uint64_t deadline = thpool_p->block_timeout_ms
+	                  ? clock_now_ns() + (uint64_t)thpool_p->block_timeout_ms * 1000000ULL : 0;
+	int rc = 0;
+	atomic_fetch_add(&jobqueue_p->num_blocked, 1);
+	while (!thpool_has_room(thpool_p, num_jobs)){
+		if (atomic_load(&jobqueue_p->closed)){
+			rc = -1;
+			break;
+		}
+		if (deadline == 0){
+			bsem_wait(jobqueue_p->has_space);
+			continue;
+		}
+		uint64_t now = clock_now_ns();
+		if (now >= deadline){
+			atomic_fetch_add_explicit(&thpool_p->num_timed_out, num_jobs, memory_order_relaxed);
+			rc = -1;
+			break;
+		}
+		int remaining_ms = (int)((deadline - now + 999999ULL) / 1000000ULL);
+		bsem_wait_timeout(jobqueue_p->has_space, remaining_ms);
 	}
-	free(thpool_p->threads);
-	free(thpool_p);
+	if (rc == -1){
+		thpool_job_discard_chain(thpool_p, first);
+	}
+	atomic_fetch_sub(&jobqueue_p->num_blocked, 1);
+	return rc;
 }
 
-/* Pause all threads in threadpool */
-void thpool_pause(thpool_* thpool_p) {
-	int n;
-	for (n=0; n < thpool_p->num_threads_alive; n++){
-		pthread_kill(thpool_p->threads[n]->pthread, SIGUSR1);
-	}
+/* Whether num_jobs more fit under the limit, an empty queue takes any batch */
+static int thpool_has_room(thpool_* thpool_p, int num_jobs){
+	int len = atomic_load(&thpool_p->jobqueue.len);
+	return len <= 0 || len + num_jobs <= thpool_p->queue_limit;
 }
 
-/* Resume all threads in threadpool */
-void thpool_resume(thpool_* thpool_p) {
-    // resuming a single threadpool hasn't been
-    // implemented yet, meanwhile this suppresses
-    // the warnings
-    (void)thpool_p;
+/* Throw away up to num_jobs of the oldest queued jobs, lowest priority first
+ *
+ * Jobs in worker deques are left alone. The pool's own trampolines and
+ * jobs with a done callback are never victims, they stay queued and the
+ * next plain job goes instead. The ring can only give up its head, so
+ * those are pulled and put back at its tail.
+ *
+ * @return how many of num_jobs could not be dropped
+ */
+static int thpool_drop_oldest(thpool_* thpool_p, int num_jobs, int is_worker){
+	jobqueue* jobqueue_p = &thpool_p->jobqueue;
+	int p;
+	for (p=THPOOL_NUM_PRIO-1; p >= 0 && num_jobs > 0; p--){
+		job* kept_first = NULL;
+		job* kept_last  = NULL;
+		int  num_kept   = 0;
+		int  num_left   = atomic_load(&jobqueue_p->depth[p]);
+		job* job_p;
+		while (num_jobs > 0 && num_left-- > 0
+		       && (job_p = jobqueue_pull_oldest(jobqueue_p, p, thpool_job_droppable)) != NULL){
+			if (!thpool_job_droppable(job_p)){
+				job_p->prev = NULL;
+				if (kept_last == NULL){
+					kept_first = job_p;
+				}
+				else {
+					kept_last->prev = job_p;
+				}
+				kept_last = job_p;
+				num_kept++;
+				continue;
+			}
+			num_jobs--;
+			if (thpool_job_discard(thpool_p, job_p)){
+				atomic_fetch_add_explicit(&thpool_p->num_dropped, 1, memory_order_relaxed);
+			}
+		}
+		if (num_kept == 0){
+			continue;
+		}
 
-	threads_on_hold = 0;
+		/* Only a worker gets a leftover back, it must not wait on its own pool */
+		job_p = jobqueue_push_chain(jobqueue_p, kept_first, kept_last, num_kept, p, !is_worker);
+		while (job_p != NULL){
+			job* next = job_p->prev;
+			atomic_fetch_add_explicit(&thpool_p->num_caller_ran, 1, memory_order_relaxed);
+			thread_run_job(thpool_p, job_p);
+			job_p = next;
+		}
+	}
+	return num_jobs;
 }
 
-int thpool_num_threads_working(thpool_* thpool_p){
-	return thpool_p->num_threads_working;
+/* Whether a queued job may be thrown away by DROP_OLDEST
+ *
+ * Futures, timers, parallel_for, task graphs, fibers and jobs with a
+ * done callback have somebody waiting on them.
+ */
+static int thpool_job_droppable(const struct job* job_p){
+	return job_p->function != future_run && job_p->function != timer_run
+	    && job_p->function != parallel_for_run && job_p->function != graph_node_run
+	    && job_p->function != fiber_run && job_p->done == NULL;
 }
-/* ============================ THREAD ============================== */
-/* Initialize a thread in the thread pool
+
+/* Hand a finished job with a done callback to thpool_poll_completions()
  *
- * @param thread        address to the pointer of the thread to be created
- * @param id            id to be given to the thread
- * @return 0 on success, -1 otherwise.
+ * Only the push onto an empty stack signals the eventfd, the poller
+ * takes everything on the stack at once.
  */
-static int thread_init (thpool_* thpool_p, struct thread** thread_p, int id){
+static void thpool_job_complete(thpool_* thpool_p, struct job* job_p){
+	job* head = atomic_load_explicit(&thpool_p->completions, memory_order_relaxed);
+	do {
+		job_p->prev = head;
+	} while (!atomic_compare_exchange_weak(&thpool_p->completions, &head, job_p));
 
-	*thread_p = (struct thread*)malloc(sizeof(struct thread));
-	if (*thread_p == NULL){
-		err("thread_init(): Could not allocate memory for thread\n");
-		return -1;
+	int fd = atomic_load(&thpool_p->completion_fd);
+	if (head == NULL && fd != -1){
+		eventfd_write(fd, 1);
 	}
-
-	(*thread_p)->thpool_p = thpool_p;
-	(*thread_p)->id       = id;
-
-	pthread_create(&(*thread_p)->pthread, NULL, (void * (*)(void *)) thread_do, (*thread_p));
-	pthread_detach((*thread_p)->pthread);
-	return 0;
 }
-/* Sets the calling thread on hold */
-static void thread_hold(int sig_id) {
-    (void)sig_id;
-	threads_on_hold = 1;
-	while (threads_on_hold){
-		sleep(1);
+
+/* Free a job that will never run and take it off its group's books
+ *
+ * @return 1 if the job was still live, 0 if it had been cancelled
+ */
+static int thpool_job_discard(thpool_* thpool_p, struct job* job_p){
+	thpool_group_* group_p = job_p->group;
+	int live = 1;
+	if (group_p != NULL){
+		live = group_claim(group_p, job_p) == 0;
+		if (live){
+			group_done(group_p, 1);
+		}
+		group_put(group_p);
+	}
+	slab_free(&thpool_p->jobqueue.slab, job_p);
+	if (live){
+		group_done(&thpool_p->all, 1);
 	}
+	return live;
 }
-/* What each thread is doing
-*
-* In principle this is an endless loop. The only time this loop gets interrupted is once
-* thpool_destroy() is invoked or the program exits.
-*
-* @param  thread        thread that will run this function
-* @return nothing
-*/
-static void* thread_do(struct thread* thread_p){
 
-	/* Set thread name for profiling and debugging */
-	char thread_name[16] = {0};
+/* Discard a chain of jobs linked through prev */
+static void thpool_job_discard_chain(thpool_* thpool_p, struct job* first){
+	while (first != NULL){
+		job* next = first->prev;
+		thpool_job_discard(thpool_p, first);
+		first = next;
+	}
+}
 
-	snprintf(thread_name, 16, TOSTRING(THPOOL_THREAD_NAME) "-%d", thread_p->id);
+/* Add work to the thread pool */
+int thpool_add_work(thpool_* thpool_p, void (*function_p)(void*), void* arg_p){
+	return thpool_add_work_prio(thpool_p, function_p, arg_p, THPOOL_PRIO_NORMAL);
+}
 
-	/* Use prctl instead to prevent using _GNU_SOURCE flag and implicit declaration */
-	prctl(PR_SET_NAME, thread_name);
+/* Add work to the thread pool with the given priority */
+int thpool_add_work_prio(thpool_* thpool_p, void (*function_p)(void*), void* arg_p, thpool_priority prio){
+	job* newjob;
 
-	/* Assure all threads have been created before starting serving */
-	thpool_* thpool_p = thread_p->thpool_p;
+	if (prio < 0 || prio >= THPOOL_NUM_PRIO){
+		err("thpool_add_work_prio(): Invalid priority\n");
+		return -1;
+	}
 
-	/* Register signal handler */
-	struct sigaction act;
-	sigemptyset(&act.sa_mask);
-	act.sa_flags = SA_ONSTACK;
-	act.sa_handler = thread_hold;
-	if (sigaction(SIGUSR1, &act, NULL) == -1) {
-		err("thread_do(): cannot handle SIGUSR1");
+	newjob=slab_alloc(&thpool_p->jobqueue.slab);
+	if (newjob==NULL){
+		err("thpool_add_work(): Could not allocate memory for new job\n");
+		return -1;
 	}
 
-	/* Mark thread as alive (initialized) */
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	thpool_p->num_threads_alive += 1;
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
+	/* add function and argument */
+	job_init(newjob, function_p, arg_p, prio);
 
-	while(threads_keepalive){
+	return thpool_push_jobs(thpool_p, newjob, newjob, 1, prio);
+}
 
-		bsem_wait(thpool_p->jobqueue.has_jobs);
+/* Add work to the thread pool that has to finish by deadline_ns */
+int thpool_add_work_deadline(thpool_* thpool_p, void (*function_p)(void*), void* arg_p, uint64_t deadline_ns){
+	return thpool_push_deadline(thpool_p, function_p, arg_p, deadline_ns, function_p);
+}
 
-		if (threads_keepalive){
+/* Queue a deadline job, its outcome is counted under task_p */
+static int thpool_push_deadline(thpool_* thpool_p, void (*function_p)(void*), void* arg_p, uint64_t deadline_ns, void (*task_p)(void*)){
+	job* newjob = slab_alloc(&thpool_p->jobqueue.slab);
+	if (newjob == NULL){
+		err("thpool_add_work_deadline(): Could not allocate memory for new job\n");
+		return -1;
+	}
 
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working++;
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
+	job_init(newjob, function_p, arg_p, THPOOL_PRIO_NORMAL);
+	newjob->deadline_ns = deadline_ns;
+	newjob->task        = task_p;
 
-			/* Read job from queue and execute it */
-			void (*func_buff)(void*);
-			void*  arg_buff;
-			job* job_p = jobqueue_pull(&thpool_p->jobqueue);
-			if (job_p) {
-				func_buff = job_p->function;
-				arg_buff  = job_p->arg;
-				func_buff(arg_buff);
-				free(job_p);
-			}
+	return thpool_push_jobs(thpool_p, newjob, newjob, 1, THPOOL_PRIO_NORMAL);
+}
 
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working--;
-			if (!thpool_p->num_threads_working) {
-				pthread_cond_signal(&thpool_p->threads_all_idle);
-			}
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
+/* Current time on the clock deadlines are given in */
+uint64_t thpool_clock_ns(void){
+	return clock_now_ns();
+}
 
-		}
+/* Add work to the thread pool, its arguments copied into the job */
+int thpool_add_work_inline(thpool_* thpool_p, void (*function_p)(void*), const void* args_p, size_t size){
+	if (size > THPOOL_INLINE_ARGS_SIZE){
+		err("thpool_add_work_inline(): Arguments too large\n");
+		return -1;
 	}
-	pthread_mutex_lock(&thpool_p->thcount_lock);
-	thpool_p->num_threads_alive --;
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
 
-	return NULL;
-}
+	job* newjob = slab_alloc(&thpool_p->jobqueue.slab);
+	if (newjob == NULL){
+		err("thpool_add_work_inline(): Could not allocate memory for new job\n");
+		return -1;
+	}
 
-/* Frees a thread  */
-static void thread_destroy (thread* thread_p){
-	free(thread_p);
+	memcpy(newjob->inline_args, args_p, size);
+	job_init(newjob, function_p, newjob->inline_args, THPOOL_PRIO_NORMAL);
+
+	return thpool_push_jobs(thpool_p, newjob, newjob, 1, THPOOL_PRIO_NORMAL);
 }
-/* ============================ JOB QUEUE =========================== */
-/* Initialize queue */
-static int jobqueue_init(jobqueue* jobqueue_p){
-	jobqueue_p->len = 0;
-	jobqueue_p->front = NULL;
-	jobqueue_p->rear  = NULL;
 
-	jobqueue_p->has_jobs = (struct bsem*)malloc(sizeof(struct bsem));
-	if (jobqueue_p->has_jobs == NULL){
+/* Add work whose done callback runs in thpool_poll_completions() */
+int thpool_add_work_notify(thpool_* thpool_p, void (*function_p)(void*), void (*done_p)(void*), void* arg_p){
+	job* newjob = slab_alloc(&thpool_p->jobqueue.slab);
+	if (newjob == NULL){
+		err("thpool_add_work_notify(): Could not allocate memory for new job\n");
 		return -1;
 	}
 
-	pthread_mutex_init(&(jobqueue_p->rwmutex), NULL);
-	bsem_init(jobqueue_p->has_jobs, 0);
+	job_init(newjob, function_p, arg_p, THPOOL_PRIO_NORMAL);
+	newjob->done = done_p;
 
-	return 0;
+	return thpool_push_jobs(thpool_p, newjob, newjob, 1, THPOOL_PRIO_NORMAL);
 }
 
-/* Clear the queue */
-static void jobqueue_clear(jobqueue* jobqueue_p){
-
-	while(jobqueue_p->len){
-		free(jobqueue_pull(jobqueue_p));
+/* Get the eventfd that turns readable when done callbacks are waiting */
+int thpool_completion_fd(thpool_* thpool_p){
+	int fd = atomic_load(&thpool_p->completion_fd);
+	if (fd != -1){
+		return fd;
 	}
 
-	jobqueue_p->front = NULL;
-	jobqueue_p->rear  = NULL;
-	bsem_reset(jobqueue_p->has_jobs);
-	jobqueue_p->len = 0;
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	fd = atomic_load(&thpool_p->completion_fd);
+	if (fd == -1){
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd == -1){
+			err("thpool_completion_fd(): Could not create eventfd\n");
+			pthread_mutex_unlock(&thpool_p->thcount_lock);
+			return -1;
+		}
+		atomic_store(&thpool_p->completion_fd, fd);
+		/* Jobs that finished before there was an fd to signal */
+		if (atomic_load(&thpool_p->completions) != NULL){
+			eventfd_write(fd, 1);
+		}
+	}
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+	return fd;
+}
+
+/* Run the done callbacks of finished jobs in the calling thread */
+int thpool_poll_completions(thpool_* thpool_p){
+	/* Clear the fd first, a job finishing from here on signals it again */
+	int fd = atomic_load(&thpool_p->completion_fd);
+	if (fd != -1){
+		eventfd_t value;
+		eventfd_read(fd, &value);
+	}
+
+	job* job_p = atomic_exchange(&thpool_p->completions, NULL);
+
+	/* The stack holds the newest first, run them in completion order */
+	job* ordered = NULL;
+	while (job_p != NULL){
+		job* next = job_p->prev;
+		job_p->prev = ordered;
+		ordered = job_p;
+		job_p = next;
+	}
+
+	int num_done = 0;
+	while (ordered != NULL){
+		job* next = ordered->prev;
+		void (*done_buff)(void*) = ordered->done;
+		void*  arg_buff = ordered->arg;
+		slab_free(&thpool_p->jobqueue.slab, ordered);
+		done_buff(arg_buff);
+		num_done++;
+		ordered = next;
+	}
+	return num_done;
+}
+
+/* Add several jobs to the thread pool at once */
+int thpool_add_work_batch(thpool_* thpool_p, void (*function_p[])(void*), void* arg_p[], int num_jobs){
+	if (num_jobs <= 0){
+		return 0;
+	}
+
+	/* Build the chain first so the queue is only touched once */
+	job* first = NULL;
+	job* last  = NULL;
+	int n;
+	for (n=0; n<num_jobs; n++){
+		job* newjob = slab_alloc(&thpool_p->jobqueue.slab);
+		if (newjob == NULL){
+			err("thpool_add_work_batch(): Could not allocate memory for new job\n");
+			while (first != NULL){
+				job* next = first->prev;
+				slab_free(&thpool_p->jobqueue.slab, first);
+				first = next;
+			}
+			return -1;
+		}
+		job_init(newjob, function_p[n], arg_p[n], THPOOL_PRIO_NORMAL);
+		if (last == NULL){
+			first = newjob;
+		}
+		else {
+			last->prev = newjob;
+		}
+		last = newjob;
+	}
+
+	return thpool_push_jobs(thpool_p, first, last, num_jobs, THPOOL_PRIO_NORMAL);
+}
+
+/* Make a group to submit related jobs under */
+struct thpool_group_* thpool_group_create(thpool_* thpool_p){
+	thpool_group_* group_p = (struct thpool_group_*)malloc(sizeof(struct thpool_group_));
+	if (group_p == NULL){
+		err("thpool_group_create(): Could not allocate memory for group\n");
+		return NULL;
+	}
+	group_init(group_p, thpool_p);
+	return group_p;
+}
+
+/* Add work to the thread pool as part of a group */
+int thpool_add_work_group(thpool_group_* group_p, void (*function_p)(void*), void* arg_p){
+	thpool_* thpool_p = group_p->thpool_p;
+	job* newjob = slab_alloc(&thpool_p->jobqueue.slab);
+	if (newjob == NULL){
+		err("thpool_add_work_group(): Could not allocate memory for new job\n");
+		return -1;
+	}
+
+	job_init(newjob, function_p, arg_p, THPOOL_PRIO_NORMAL);
+	newjob->group = group_p;
+
+	return thpool_push_jobs(thpool_p, newjob, newjob, 1, THPOOL_PRIO_NORMAL);
+}
+
+/* Drop the group's jobs that haven't started yet */
+int thpool_cancel_group(thpool_group_* group_p){
+	jobqueue* jobqueue_p = &group_p->thpool_p->jobqueue;
+	int num_cancelled = 0;
+	job* removed = NULL;
+
+	pthread_mutex_lock(&group_p->mutex);
+	job* job_p;
+	for (job_p = group_p->jobs; job_p != NULL; job_p = job_p->group_next){
+		job_p->cancelled = 1;
+		num_cancelled++;
+
+		/* The EDF heap knows where the job is, take it out now */
+		if (jobqueue_p->type == THPOOL_QUEUE_EDF){
+			pthread_mutex_lock(&jobqueue_p->rwmutex);
+			if (job_p->heap_index != -1){
+				jobheap_remove(&jobqueue_p->heap[job_p->prio], job_p);
+				job_p->prev = removed;
+				removed = job_p;
+			}
+			pthread_mutex_unlock(&jobqueue_p->rwmutex);
+		}
+	}
+	group_p->jobs = NULL;
+	pthread_mutex_unlock(&group_p->mutex);
+
+	while (removed != NULL){
+		job* next = removed->prev;
+		int prio = removed->prio;
+		slab_free(&jobqueue_p->slab, removed);
+		group_put(group_p);
+		jobqueue_taken(jobqueue_p, prio);
+		removed = next;
+	}
+
+	/* Other queue slots go when a worker pulls them, the waiters go now */
+	if (num_cancelled){
+		group_done(group_p, num_cancelled);
+		group_done(&group_p->thpool_p->all, num_cancelled);
+	}
+	return num_cancelled;
+}
+
+/* Wait until every job of the group has finished or been cancelled */
+void thpool_wait_group(thpool_group_* group_p){
+	group_wait(group_p);
+}
+
+/* Give a group handle back, its queued jobs still run */
+void thpool_group_destroy(thpool_group_* group_p){
+	if (group_p == NULL) return ;
+	group_put(group_p);
+}
+
+/* Add work and get a handle to wait for it */
+struct thpool_future_* thpool_submit(thpool_* thpool_p, void* (*function_p)(void*), void* arg_p){
+	thpool_future_* future_p = (struct thpool_future_*)slab_alloc(&thpool_p->future_slab);
+	if (future_p == NULL){
+		err("thpool_submit(): Could not allocate memory for future\n");
+		return NULL;
+	}
+
+	/* Slab handles keep their mutex and condvar, heap ones need theirs */
+	if (!slab_owns(&thpool_p->future_slab, future_p)){
+		future_sync_init(future_p);
+	}
+	future_p->thpool_p = thpool_p;
+	future_p->function = function_p;
+	future_p->arg      = arg_p;
+	future_p->result   = NULL;
+	atomic_init(&future_p->done, 0);
+	atomic_init(&future_p->refs, 2);
+	atomic_init(&future_p->num_waiters, 0);
+
+	if (thpool_add_work(thpool_p, future_run, future_p) == -1){
+		atomic_store(&future_p->refs, 1);
+		future_put(future_p);
+		return NULL;
+	}
+
+	return future_p;
+}
+
+/* Check whether a submitted job has finished */
+int thpool_future_try_wait(thpool_future_* future_p, void** result_p){
+	if (!atomic_load_explicit(&future_p->done, memory_order_acquire)){
+		return -1;
+	}
+	if (result_p != NULL){
+		*result_p = future_p->result;
+	}
+	return 0;
+}
+
+/* Wait for a submitted job to finish */
+int thpool_future_wait(thpool_future_* future_p, void** result_p){
+	return thpool_future_wait_timeout(future_p, -1, result_p);
+}
+
+/* Wait at most timeout_ms for a submitted job to finish */
+int thpool_future_wait_timeout(thpool_future_* future_p, int timeout_ms, void** result_p){
+	if (thpool_future_try_wait(future_p, result_p) == 0){
+		return 0;
+	}
+	if (timeout_ms == 0){
+		return -1;
+	}
+
+	struct timespec deadline;
+	if (timeout_ms > 0){
+		deadline_after(&deadline, timeout_ms);
+	}
+
+	/* Announce ourselves before the recheck, pairs with future_run() */
+	pthread_mutex_lock(&future_p->mutex);
+	atomic_fetch_add(&future_p->num_waiters, 1);
+	int rc = 0;
+	while (!atomic_load(&future_p->done) && rc != ETIMEDOUT){
+		if (timeout_ms > 0){
+			rc = pthread_cond_timedwait(&future_p->cond, &future_p->mutex, &deadline);
+		}
+		else {
+			pthread_cond_wait(&future_p->cond, &future_p->mutex);
+		}
+	}
+	atomic_fetch_sub(&future_p->num_waiters, 1);
+	pthread_mutex_unlock(&future_p->mutex);
+
+	return thpool_future_try_wait(future_p, result_p);
+}
+
+/* Give a future handle back to its pool */
+void thpool_future_release(thpool_future_* future_p){
+	if (future_p == NULL) return ;
+	future_put(future_p);
+}
+
+/* Run a job once, delay_ms from now */
+struct thpool_timer_* thpool_schedule_after(thpool_* thpool_p, int delay_ms, void (*function_p)(void*), void* arg_p){
+	return timer_schedule(thpool_p, delay_ms, 0, function_p, arg_p);
+}
+
+/* Run a job every period_ms, the first time period_ms from now */
+struct thpool_timer_* thpool_schedule_every(thpool_* thpool_p, int period_ms, void (*function_p)(void*), void* arg_p){
+	if (period_ms <= 0){
+		err("thpool_schedule_every(): Period must be positive\n");
+		return NULL;
+	}
+	return timer_schedule(thpool_p, period_ms, period_ms, function_p, arg_p);
+}
+
+/* Stop a timer and give its handle back */
+int thpool_timer_cancel(thpool_timer_* timer_p){
+	if (timer_p == NULL) return -1;
+
+	timerwheel* wheel_p = &timer_p->thpool_p->timers;
+	int was_queued;
+	pthread_mutex_lock(&wheel_p->lock);
+	atomic_store(&timer_p->cancelled, 1);
+	was_queued = timer_p->queued;
+	if (was_queued){
+		timerwheel_remove(wheel_p, timer_p);
+	}
+	pthread_mutex_unlock(&wheel_p->lock);
+
+	/* The wheel's reference, then ours */
+	if (was_queued){
+		timer_put(timer_p);
+	}
+	timer_put(timer_p);
+
+	return was_queued ? 0 : -1;
+}
+
+/* Give a timer handle back, the timer keeps running */
+void thpool_timer_release(thpool_timer_* timer_p){
+	if (timer_p == NULL) return ;
+	timer_put(timer_p);
+}
+
+/* Run function over [begin, end) split across the pool */
+void thpool_parallel_for(thpool_* thpool_p, long begin, long end, long grain,
+                         void (*function_p)(long begin, long end, void* ctx), void* ctx){
+	if (end <= begin){
+		return;
+	}
+
+	long total = end - begin;
+	int  num_threads = thpool_num_threads_alive(thpool_p);
+
+	/* Default grain leaves a few chunks per participant for balancing */
+	if (grain <= 0){
+		grain = total / (8L * (num_threads + 1));
+		if (grain < 1){
+			grain = 1;
+		}
+	}
+
+	/* Too small to be worth splitting */
+	long num_chunks = (total + grain - 1) / grain;
+	if (num_threads == 0 || num_chunks < 2){
+		function_p(begin, end, ctx);
+		return;
+	}
+
+	int num_helpers = num_chunks - 1 < num_threads ? (int)(num_chunks - 1) : num_threads;
+
+	/* Helpers may start after we return, so the range lives on the heap */
+	parallel_for* pf_p = (struct parallel_for*)malloc(sizeof(struct parallel_for));
+	if (pf_p == NULL){
+		err("thpool_parallel_for(): Could not allocate memory, running serially\n");
+		function_p(begin, end, ctx);
+		return;
+	}
+	pf_p->function    = function_p;
+	pf_p->ctx         = ctx;
+	pf_p->end         = end;
+	pf_p->grain       = grain;
+	pf_p->num_workers = num_helpers + 1;
+	atomic_init(&pf_p->next, begin);
+	atomic_init(&pf_p->num_left, total);
+	atomic_init(&pf_p->refs, num_helpers + 1);
+	atomic_init(&pf_p->num_waiters, 0);
+	pthread_mutex_init(&pf_p->mutex, NULL);
+	pthread_cond_init(&pf_p->cond, NULL);
+
+	/* One batch for all helpers, then lend a hand ourselves */
+	void (*funcs[num_helpers])(void*);
+	void*  args[num_helpers];
+	int n;
+	for (n=0; n<num_helpers; n++){
+		funcs[n] = parallel_for_run;
+		args[n]  = pf_p;
+	}
+	if (thpool_add_work_batch(thpool_p, funcs, args, num_helpers) == -1){
+		atomic_store(&pf_p->refs, 1);
+	}
+
+	parallel_for_work(pf_p);
+
+	/* Chunks claimed by helpers may still be running */
+	if (atomic_load(&pf_p->num_left) != 0){
+		pthread_mutex_lock(&pf_p->mutex);
+		atomic_fetch_add(&pf_p->num_waiters, 1);
+		while (atomic_load(&pf_p->num_left) != 0){
+			pthread_cond_wait(&pf_p->cond, &pf_p->mutex);
+		}
+		atomic_fetch_sub(&pf_p->num_waiters, 1);
+		pthread_mutex_unlock(&pf_p->mutex);
+	}
+
+	parallel_for_put(pf_p);
+}
+
+/* Make an empty task graph */
+struct thpool_graph_* thpool_graph_create(thpool_* thpool_p){
+	thpool_graph_* graph_p = (struct thpool_graph_*)calloc(1, sizeof(struct thpool_graph_));
+	if (graph_p == NULL){
+		err("thpool_graph_create(): Could not allocate memory for graph\n");
+		return NULL;
+	}
+	graph_p->thpool_p = thpool_p;
+	atomic_init(&graph_p->running, 0);
+	atomic_init(&graph_p->num_left, 0);
+	pthread_mutex_init(&graph_p->mutex, NULL);
+	pthread_cond_init(&graph_p->cond, NULL);
+	return graph_p;
+}
+
+/* Add a node to a task graph */
+int thpool_graph_add_node(thpool_graph_* graph_p, void (*function_p)(void*), void* arg_p){
+	if (atomic_load(&graph_p->running)){
+		err("thpool_graph_add_node(): Graph is running\n");
+		return -1;
+	}
+	if (graph_p->num_nodes == graph_p->max_nodes){
+		int max_nodes = graph_p->max_nodes ? graph_p->max_nodes * 2 : 8;
+		graph_node* nodes = (struct graph_node*)realloc(graph_p->nodes, max_nodes * sizeof(struct graph_node));
+		if (nodes == NULL){
+			err("thpool_graph_add_node(): Could not allocate memory for node\n");
+			return -1;
+		}
+		graph_p->nodes     = nodes;
+		graph_p->max_nodes = max_nodes;
+	}
+
+	graph_node* node_p = &graph_p->nodes[graph_p->num_nodes];
+	node_p->graph_p          = graph_p;
+	node_p->function         = function_p;
+	node_p->arg              = arg_p;
+	node_p->successors       = NULL;
+	node_p->num_successors   = 0;
+	node_p->max_successors   = 0;
+	node_p->num_predecessors = 0;
+	atomic_init(&node_p->num_left, 0);
+	graph_p->sealed = 0;
+
+	return graph_p->num_nodes++;
+}
+
+/* Have node "to" wait for node "from" */
+int thpool_graph_add_edge(thpool_graph_* graph_p, int from, int to){
+	if (from < 0 || from >= graph_p->num_nodes || to < 0 || to >= graph_p->num_nodes || from == to){
+		err("thpool_graph_add_edge(): Invalid node\n");
+		return -1;
+	}
+	if (atomic_load(&graph_p->running)){
+		err("thpool_graph_add_edge(): Graph is running\n");
+		return -1;
+	}
+
+	graph_node* node_p = &graph_p->nodes[from];
+	if (node_p->num_successors == node_p->max_successors){
+		int max_successors = node_p->max_successors ? node_p->max_successors * 2 : 4;
+		int* successors = (int*)realloc(node_p->successors, max_successors * sizeof(int));
+		if (successors == NULL){
+			err("thpool_graph_add_edge(): Could not allocate memory for edge\n");
+			return -1;
+		}
+		node_p->successors     = successors;
+		node_p->max_successors = max_successors;
+	}
+	node_p->successors[node_p->num_successors++] = to;
+	graph_p->nodes[to].num_predecessors++;
+	graph_p->sealed = 0;
+
+	return 0;
+}
+
+/* Run every node of a task graph once, in dependency order */
+int thpool_graph_run(thpool_graph_* graph_p){
+	if (graph_p->num_nodes == 0){
+		return 0;
+	}
+	if (atomic_exchange(&graph_p->running, 1)){
+		err("thpool_graph_run(): Graph is already running\n");
+		return -1;
+	}
+	if (!graph_p->sealed && graph_seal(graph_p) == -1){
+		atomic_store(&graph_p->running, 0);
+		return -1;
+	}
+
+	/* Reset the counters, submitting the roots publishes them */
+	int n;
+	for (n=0; n<graph_p->num_nodes; n++){
+		atomic_store_explicit(&graph_p->nodes[n].num_left, graph_p->nodes[n].num_predecessors,
+		                      memory_order_relaxed);
+	}
+	atomic_store_explicit(&graph_p->num_left, graph_p->num_nodes, memory_order_relaxed);
+	graph_p->finished = 0;
+
+	/* All roots in one batch */
+	void (*funcs[graph_p->num_roots])(void*);
+	void*  args[graph_p->num_roots];
+	for (n=0; n<graph_p->num_roots; n++){
+		funcs[n] = graph_node_run;
+		args[n]  = &graph_p->nodes[graph_p->roots[n]];
+	}
+	if (thpool_add_work_batch(graph_p->thpool_p, funcs, args, graph_p->num_roots) == -1){
+		for (n=0; n<graph_p->num_roots; n++){
+			graph_node_run(args[n]);
+		}
+	}
+
+	/* Wait on finished rather than num_left, so the last node is out of
+	 * the graph before we may return and the graph be destroyed */
+	pthread_mutex_lock(&graph_p->mutex);
+	while (!graph_p->finished){
+		pthread_cond_wait(&graph_p->cond, &graph_p->mutex);
+	}
+	pthread_mutex_unlock(&graph_p->mutex);
+
+	atomic_store(&graph_p->running, 0);
+	return 0;
+}
+
+/* Free a task graph */
+void thpool_graph_destroy(thpool_graph_* graph_p){
+	if (graph_p == NULL) return ;
+	int n;
+	for (n=0; n<graph_p->num_nodes; n++){
+		free(graph_p->nodes[n].successors);
+	}
+	free(graph_p->nodes);
+	free(graph_p->roots);
+	pthread_mutex_destroy(&graph_p->mutex);
+	pthread_cond_destroy(&graph_p->cond);
+	free(graph_p);
+}
+
+/* Start a function as a fiber on the pool */
+int thpool_fiber_spawn(thpool_* thpool_p, void (*function_p)(void*), void* arg_p, size_t stack_size){
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	if (stack_size == 0){
+		stack_size = THPOOL_FIBER_STACK_DEFAULT;
+	}
+	stack_size = (stack_size + page - 1) & ~(page - 1);
+
+	fiber* fiber_p = (struct fiber*)malloc(sizeof(struct fiber));
+	if (fiber_p == NULL){
+		err("thpool_fiber_spawn(): Could not allocate memory for fiber\n");
+		return -1;
+	}
+
+	/* Stacks grow down, an overflow runs into the guard page and faults */
+	fiber_p->stack_size = stack_size + page;
+	fiber_p->stack = (char*)mmap(NULL, fiber_p->stack_size, PROT_READ | PROT_WRITE,
+	                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (fiber_p->stack == MAP_FAILED){
+		err("thpool_fiber_spawn(): Could not allocate memory for fiber stack\n");
+		free(fiber_p);
+		return -1;
+	}
+	mprotect(fiber_p->stack, page, PROT_NONE);
+
+	getcontext(&fiber_p->context);
+	fiber_p->context.uc_stack.ss_sp   = fiber_p->stack + page;
+	fiber_p->context.uc_stack.ss_size = stack_size;
+	fiber_p->context.uc_link          = NULL;
+	makecontext(&fiber_p->context, fiber_main, 0);
+
+	fiber_p->thpool_p = thpool_p;
+	fiber_p->function = function_p;
+	fiber_p->arg      = arg_p;
+	fiber_p->park     = FIBER_RUNNING;
+	fiber_p->revents  = 0;
+
+	fiberpoll* poll_p = &thpool_p->fibers;
+	pthread_mutex_lock(&poll_p->lock);
+	fiber_p->prev = NULL;
+	fiber_p->next = poll_p->fibers;
+	if (poll_p->fibers != NULL){
+		poll_p->fibers->prev = fiber_p;
+	}
+	poll_p->fibers = fiber_p;
+	pthread_mutex_unlock(&poll_p->lock);
+
+	if (thpool_add_work(thpool_p, fiber_run, fiber_p) == -1){
+		fiber_free(fiber_p);
+		return -1;
+	}
+	return 0;
+}
+
+/* Let other jobs and fibers run, then carry on */
+void thpool_fiber_yield(void){
+	fiber* fiber_p = fiber_self;
+	if (fiber_p == NULL){
+		sched_yield();
+		return;
+	}
+	fiber_switch(fiber_p, FIBER_YIELD);
+}
+
+/* Sleep without holding on to a worker */
+int thpool_fiber_sleep(int ms){
+	fiber* fiber_p = fiber_self;
+	if (fiber_p == NULL){
+		struct timespec ts;
+		ts.tv_sec  = ms / 1000;
+		ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR){
+		}
+		return 0;
+	}
+	if (ms <= 0){
+		fiber_switch(fiber_p, FIBER_YIELD);
+		return 0;
+	}
+	fiber_p->park_ms = ms;
+	fiber_p->revents = 0;
+	fiber_switch(fiber_p, FIBER_SLEEP);
+	/* Resumed, maybe on another worker, fiber_p is still ours */
+	return fiber_p->revents;
+}
+
+/* Wait for an fd without holding on to a worker */
+int thpool_fiber_wait_fd(int fd, int events){
+	fiber* fiber_p = fiber_self;
+	if (fiber_p == NULL){
+		struct pollfd pfd;
+		pfd.fd      = fd;
+		pfd.events  = (short)events;
+		pfd.revents = 0;
+		int rc;
+		while ((rc = poll(&pfd, 1, -1)) == -1 && errno == EINTR){
+		}
+		return rc == -1 ? -1 : pfd.revents;
+	}
+	fiber_p->park_fd     = fd;
+	fiber_p->park_events = events;
+	fiber_switch(fiber_p, FIBER_WAIT_FD);
+	/* Resumed, maybe on another worker, fiber_p is still ours */
+	return fiber_p->revents;
+}
+
+/* Wait until all jobs have finished, the pool is one big group */
+void thpool_wait(thpool_* thpool_p){
+	group_wait(&thpool_p->all);
+}
+
+/* Destroy the threadpool */
+void thpool_destroy(thpool_* thpool_p){
+	/* No need to destroy if it's NULL */
+	if (thpool_p == NULL) return ;
+
+	int threads_total = thpool_p->num_threads;
+
+	/* No more timer jobs from here on, nor fibers woken by their fds */
+	timerwheel_destroy(&thpool_p->timers);
+	fiberpoll_stop(&thpool_p->fibers);
+
+	/* End each thread 's infinite loop */
+	atomic_store(&thpool_p->keepalive, 0);
+
+	/* Producers waiting for room would never get any */
+	jobqueue_close(&thpool_p->jobqueue);
+
+	/* Let paused threads out */
+	pthread_mutex_lock(&thpool_p->hold_lock);
+	pthread_cond_broadcast(&thpool_p->hold_cond);
+	pthread_mutex_unlock(&thpool_p->hold_lock);
+
+	/* One wakeup per thread as poison pill. Wakeups stack, so a thread
+	 * that checked keepalive just before it was cleared still gets one */
+	bsem_post_n(thpool_p->jobqueue.has_jobs, threads_total);
+
+	/* No thread can be added once keepalive is clear, join them all */
+	int n;
+	for (n=0; n < threads_total; n++){
+		if (thpool_p->threads[n]->joinable){
+			pthread_join(thpool_p->threads[n]->pthread, NULL);
+			thpool_p->threads[n]->joinable = 0;
+		}
+	}
+
+	/* Refused producers are still discarding their jobs */
+	while (atomic_load(&thpool_p->jobqueue.num_blocked)){
+		sched_yield();
+	}
+
+	/* Deallocs, deques hand their leftovers back to the slab */
+	for (n=0; n < threads_total; n++){
+		thread_destroy(thpool_p->threads[n]);
+	}
+
+	/* Jobs nobody ran still hold on to their groups */
+	job* job_p;
+	while ((job_p = jobqueue_pull(&thpool_p->jobqueue, 0)) != NULL){
+		thpool_job_discard(thpool_p, job_p);
+	}
+
+	/* Done callbacks nobody polled for are dropped */
+	job_p = atomic_exchange(&thpool_p->completions, NULL);
+	while (job_p != NULL){
+		job* next = job_p->prev;
+		slab_free(&thpool_p->jobqueue.slab, job_p);
+		job_p = next;
+	}
+	if (atomic_load(&thpool_p->completion_fd) != -1){
+		close(atomic_load(&thpool_p->completion_fd));
+	}
+
+	/* Fibers still asleep or waiting on an fd never wake up */
+	fiberpoll_destroy(&thpool_p->fibers);
+	/* Job queue cleanup */
+	jobqueue_destroy(&thpool_p->jobqueue);
+	uint32_t slot;
+	for (slot=0; slot<thpool_p->future_slab.size; slot++){
+		future_sync_destroy((struct thpool_future_*)slab_node(&thpool_p->future_slab, slot));
+	}
+	slab_destroy(&thpool_p->future_slab);
+	pthread_mutex_destroy(&thpool_p->thcount_lock);
+	group_destroy(&thpool_p->all);
+	pthread_cond_destroy(&thpool_p->threads_started);
+	pthread_mutex_destroy(&thpool_p->hold_lock);
+	pthread_cond_destroy(&thpool_p->hold_cond);
+	pthread_mutex_destroy(&thpool_p->timers.lock);
+	free(thpool_p->threads);
+	free(thpool_p);
+}
+
+/* Pause all threads in threadpool
+ *
+ * Raises the gate and waits for running jobs to finish. Workers raise the
+ * working count before looking at the gate, so a job either shows up in
+ * the count here or its worker sees the gate and holds.
+ */
+void thpool_pause(thpool_* thpool_p) {
+	/* Called from one of our jobs -> don't wait for ourselves, nor have
+	 * another job that pauses at the same time wait for us */
+	int self = thread_self != NULL && thread_self->thpool_p == thpool_p;
+
+	pthread_mutex_lock(&thpool_p->hold_lock);
+	atomic_fetch_add(&thpool_p->on_hold, 1);
+	if (self){
+		atomic_fetch_sub(&thpool_p->num_threads_working, 1);
+		pthread_cond_broadcast(&thpool_p->hold_cond);
+	}
+	while (atomic_load(&thpool_p->num_threads_working) > 0){
+		pthread_cond_wait(&thpool_p->hold_cond, &thpool_p->hold_lock);
+	}
+	if (self){
+		atomic_fetch_add(&thpool_p->num_threads_working, 1);
+	}
+	pthread_mutex_unlock(&thpool_p->hold_lock);
+}
+
+/* Resume all threads in threadpool once every pause is undone */
+void thpool_resume(thpool_* thpool_p) {
+	pthread_mutex_lock(&thpool_p->hold_lock);
+	if (atomic_load(&thpool_p->on_hold) > 0 && atomic_fetch_sub(&thpool_p->on_hold, 1) == 1){
+		pthread_cond_broadcast(&thpool_p->hold_cond);
+	}
+	pthread_mutex_unlock(&thpool_p->hold_lock);
+}
+
+int thpool_num_threads_working(thpool_* thpool_p){
+	return atomic_load(&thpool_p->num_threads_working);
+}
+
+int thpool_num_threads_alive(thpool_* thpool_p){
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	int num_threads_alive = thpool_p->num_threads_alive;
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+	return num_threads_alive;
+}
+
+int thpool_queue_depth(thpool_* thpool_p, thpool_priority prio){
+	if (prio < 0 || prio >= THPOOL_NUM_PRIO){
+		return 0;
+	}
+	int depth = atomic_load(&thpool_p->jobqueue.depth[prio]);
+	return depth > 0 ? depth : 0;
+}
+
+/* Snapshot of the pool's counters
+ *
+ * Every counter is read on its own without locking, so the snapshot is
+ * not atomic as a whole, but each value is one that really occurred.
+ */
+int thpool_get_stats(thpool_* thpool_p, thpool_stats* stats_p){
+	if (thpool_p == NULL || stats_p == NULL){
+		return -1;
+	}
+	memset(stats_p, 0, sizeof(*stats_p));
+
+	int len = atomic_load_explicit(&thpool_p->jobqueue.len, memory_order_relaxed);
+	stats_p->queue_depth         = len > 0 ? len : 0;
+	stats_p->queue_depth_max     = atomic_load_explicit(&thpool_p->jobqueue.len_max, memory_order_relaxed);
+	stats_p->num_jobs_pending    = atomic_load_explicit(&thpool_p->all.num_pending, memory_order_relaxed);
+	stats_p->num_threads_alive   = thpool_num_threads_alive(thpool_p);
+	stats_p->num_threads_working = atomic_load_explicit(&thpool_p->num_threads_working, memory_order_relaxed);
+	stats_p->overflow_blocked    = atomic_load_explicit(&thpool_p->num_blocked, memory_order_relaxed);
+	stats_p->overflow_timed_out  = atomic_load_explicit(&thpool_p->num_timed_out, memory_order_relaxed);
+	stats_p->overflow_rejected   = atomic_load_explicit(&thpool_p->num_rejected, memory_order_relaxed);
+	stats_p->overflow_dropped    = atomic_load_explicit(&thpool_p->num_dropped, memory_order_relaxed);
+	stats_p->overflow_caller_ran = atomic_load_explicit(&thpool_p->num_caller_ran, memory_order_relaxed);
+	stats_p->deadline_missed     = atomic_load_explicit(&thpool_p->num_deadline_missed, memory_order_relaxed);
+
+	uint64_t now = clock_now_ns();
+	int n;
+	for (n=0; n < thpool_p->num_threads && n < THPOOL_STATS_MAX_THREADS; n++){
+		thread* thread_p = thpool_p->threads[n];
+		histogram_read(&thread_p->stats.wait, &stats_p->wait);
+		histogram_read(&thread_p->stats.run, &stats_p->run);
+
+		uint64_t start = atomic_load_explicit(&thread_p->stats.start_ns, memory_order_relaxed);
+		uint64_t busy  = atomic_load_explicit(&thread_p->stats.busy_ns, memory_order_relaxed);
+		stats_p->busy_ns[n]    = busy;
+		stats_p->busy_ratio[n] = start != 0 && now > start ? (double)busy / (double)(now - start) : 0.0;
+	}
+	stats_p->num_threads = n;
+
+	return 0;
+}
+
+/* Read the deadline counters of one task */
+int thpool_get_deadline_stats(thpool_* thpool_p, void (*function_p)(void*), thpool_deadline_stats* stats_p){
+	deadline_task* task = deadline_lookup(thpool_p, function_p, 0);
+	if (task == NULL || stats_p == NULL){
+		return -1;
+	}
+	stats_p->num_runs    = atomic_load_explicit(&task->num_runs, memory_order_relaxed);
+	stats_p->num_missed  = atomic_load_explicit(&task->num_missed, memory_order_relaxed);
+	stats_p->max_late_ns = atomic_load_explicit(&task->max_late_ns, memory_order_relaxed);
+	return 0;
+}
+
+/* Upper bound of the bucket holding the given fraction of samples */
+uint64_t thpool_histogram_percentile(const thpool_histogram* histogram_p, double fraction){
+	if (histogram_p->count == 0){
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(fraction * (double)histogram_p->count);
+	if (rank >= histogram_p->count){
+		rank = histogram_p->count - 1;
+	}
+
+	uint64_t seen = 0;
+	int n;
+	for (n=0; n < THPOOL_HIST_BUCKETS; n++){
+		seen += histogram_p->buckets[n];
+		if (seen > rank){
+			break;
+		}
+	}
+	if (n >= THPOOL_HIST_BUCKETS){
+		return histogram_p->max_ns;
+	}
+
+	/* Buckets below 4 are exact, above that 4 per power of two */
+	uint64_t upper;
+	if (n < 4){
+		upper = (uint64_t)n;
+	}
+	else {
+		int shift = n / 4 - 1;
+		upper = ((uint64_t)(4 + n % 4 + 1) << shift) - 1;
+	}
+	return upper < histogram_p->max_ns ? upper : histogram_p->max_ns;
+}
+/* ============================ THREAD ============================== */
+/* Initialize a thread in the thread pool
+ *
+ * @param thread        address to the pointer of the thread to be created
+ * @param id            id to be given to the thread
+ * @return 0 on success, -1 otherwise.
+ */
+static int thread_init (thpool_* thpool_p, struct thread** thread_p, int id){
+
+	*thread_p = (struct thread*)malloc(sizeof(struct thread));
+	if (*thread_p == NULL){
+		err("thread_init(): Could not allocate memory for thread\n");
+		return -1;
+	}
+
+	(*thread_p)->thpool_p = thpool_p;
+	(*thread_p)->id       = id;
+	(*thread_p)->active   = 0;
+	(*thread_p)->joinable = 0;
+	jobdeque_init(&(*thread_p)->deque);
+	memset(&(*thread_p)->stats, 0, sizeof((*thread_p)->stats));
+
+	return 0;
+}
+
+/* Start the OS thread behind an initialized thread
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int thread_start(struct thread* thread_p){
+	if (pthread_create(&thread_p->pthread, NULL, (void * (*)(void *)) thread_do, thread_p) != 0){
+		err("thread_start(): Could not create thread\n");
+		return -1;
+	}
+	thread_p->joinable = 1;
+	return 0;
+}
+
+/* Add a worker to an elastic pool
+ *
+ * At most one worker per spawn wait period, so a single burst doesn't
+ * start every spare slot at once.
+ *
+ * @param now_ns        current monotonic time
+ */
+static void thread_grow(thpool_* thpool_p, uint64_t now_ns){
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	if (!atomic_load(&thpool_p->keepalive)
+	    || thpool_p->num_threads_active >= thpool_p->num_threads
+	    || now_ns - thpool_p->last_spawn_ns < thpool_p->spawn_wait_ns){
+		pthread_mutex_unlock(&thpool_p->thcount_lock);
+		return;
+	}
+	pthread_t retired;
+	int reap = 0;
+	int n;
+	for (n=0; n < thpool_p->num_threads; n++){
+		thread* thread_p = thpool_p->threads[n];
+		if (!thread_p->active){
+			/* A retired thread no longer uses its slot, reap it below */
+			if (thread_p->joinable){
+				retired = thread_p->pthread;
+				reap = 1;
+				thread_p->joinable = 0;
+			}
+			thread_p->active = 1;
+			if (thread_start(thread_p) == -1){
+				thread_p->active = 0;
+				break;
+			}
+			thpool_p->num_threads_active++;
+			thpool_p->last_spawn_ns = now_ns;
+#if THPOOL_DEBUG
+			printf("THPOOL_DEBUG: Added thread %d to pool \n", n);
+#endif
+			break;
+		}
+	}
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+	/* Outside the lock, the retired thread may still be on its way out */
+	if (reap){
+		pthread_join(retired, NULL);
+	}
+}
+
+/* Give up the calling worker's slot if the pool is above its minimum
+ *
+ * Only called by an idle worker, its deque is empty and nobody else
+ * pushes to it, so the slot can be reused right away. A retired worker
+ * doesn't touch the pool again, thread_grow() joins it when it reuses
+ * the slot, after dropping the lock.
+ *
+ * @return 0 if the worker should exit, -1 otherwise.
+ */
+static int thread_retire(struct thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+	int retired = -1;
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	if (thpool_p->num_threads_active > thpool_p->min_threads){
+		thread_p->active = 0;
+		thpool_p->num_threads_active--;
+		thpool_p->num_threads_alive--;
+		retired = 0;
+	}
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+	return retired;
+}
+/* Sets the calling thread on hold until its pool is resumed
+ *
+ * Called between jobs with the working count raised; the thread stops
+ * counting as working while it holds, which is what thpool_pause waits for.
+ */
+static void thread_hold(thpool_* thpool_p) {
+	pthread_mutex_lock(&thpool_p->hold_lock);
+	atomic_fetch_sub(&thpool_p->num_threads_working, 1);
+	pthread_cond_broadcast(&thpool_p->hold_cond);
+	while (atomic_load(&thpool_p->on_hold) && atomic_load(&thpool_p->keepalive)){
+		pthread_cond_wait(&thpool_p->hold_cond, &thpool_p->hold_lock);
+	}
+	atomic_fetch_add(&thpool_p->num_threads_working, 1);
+	pthread_mutex_unlock(&thpool_p->hold_lock);
+}
+
+/* Apply the pool's name, CPU affinity and scheduling policy to the calling
+ * worker. Failures are reported and the worker keeps running with what it
+ * inherited, e.g. SCHED_FIFO without CAP_SYS_NICE.
+ */
+static void thread_setup(struct thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+
+	/* Set thread name for profiling and debugging */
+	char thread_name[32] = {0};
+	snprintf(thread_name, sizeof(thread_name), "%s-%d", thpool_p->name, thread_p->id);
+	prctl(PR_SET_NAME, thread_name);
+
+	if (thpool_p->cpu_mask != 0){
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		unsigned int cpu;
+		for (cpu=0; cpu < sizeof(thpool_p->cpu_mask) * 8; cpu++){
+			if (thpool_p->cpu_mask & (1UL << cpu)){
+				CPU_SET(cpu, &cpus);
+			}
+		}
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0){
+			err("thread_setup(): Could not set CPU affinity\n");
+		}
+	}
+
+	if (thpool_p->sched_policy != SCHED_OTHER){
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = thpool_p->sched_priority;
+		if (pthread_setschedparam(pthread_self(), thpool_p->sched_policy, &param) != 0){
+			err("thread_setup(): Could not set scheduling policy\n");
+		}
+	}
+}
+/* What each thread is doing
+*
+* In principle this is an endless loop. The only time this loop gets interrupted is once
+* thpool_destroy() is invoked or the program exits.
+*
+* @param  thread        thread that will run this function
+* @return nothing
+*/
+static void* thread_do(struct thread* thread_p){
+
+	/* Name, affinity and scheduling policy */
+	thread_setup(thread_p);
+
+	/* Busy ratio counts from here, histograms keep adding up per slot */
+	atomic_store_explicit(&thread_p->stats.start_ns, clock_now_ns(), memory_order_relaxed);
+	atomic_store_explicit(&thread_p->stats.busy_ns, 0, memory_order_relaxed);
+
+	/* Spin the full limit until there are gaps to go by */
+	thread_p->idle_avg_ns = thread_p->thpool_p->spin_max_ns / 2;
+	thread_p->spin_ns     = thread_p->thpool_p->spin_max_ns;
+
+	/* Assure all threads have been created before starting serving */
+	thpool_* thpool_p = thread_p->thpool_p;
+	thread_self = thread_p;
+
+	/* Mark thread as alive (initialized) */
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	thpool_p->num_threads_alive += 1;
+	pthread_cond_signal(&thpool_p->threads_started);
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+	/* Only an elastic pool times out idle workers */
+	int elastic = thpool_p->num_threads > thpool_p->min_threads;
+	int idle_timeout_ms = elastic ? thpool_p->idle_timeout_ms : 0;
+
+	while(atomic_load(&thpool_p->keepalive)){
+
+		/* Find a job, only block when there is none anywhere */
+		job* job_p = thread_next_job(thread_p);
+		if (job_p == NULL){
+			uint64_t idle_ns = thpool_p->spin_max_ns ? clock_now_ns() : 0;
+			if (thread_spin(thread_p, idle_ns)){
+				thread_spin_update(thread_p, clock_now_ns() - idle_ns);
+				continue;
+			}
+			if (jobqueue_park(&thpool_p->jobqueue, &thpool_p->keepalive, idle_timeout_ms) == -1
+			    && thread_retire(thread_p) == 0){
+#if THPOOL_DEBUG
+				printf("THPOOL_DEBUG: Retired thread %d from pool \n", thread_p->id);
+#endif
+				return NULL;
+			}
+			if (thpool_p->spin_max_ns){
+				thread_spin_update(thread_p, clock_now_ns() - idle_ns);
+			}
+			continue;
+		}
+
+		/* Jobs waiting too long -> add a worker */
+		if (elastic){
+			uint64_t now = clock_now_ns();
+			atomic_store_explicit(&thpool_p->last_take_ns, now, memory_order_relaxed);
+			if (now - job_p->queued_ns > thpool_p->spawn_wait_ns){
+				thread_grow(thpool_p, now);
+			}
+		}
+
+		/* Count as working before checking the gate, pairs with thpool_pause */
+		atomic_fetch_add(&thpool_p->num_threads_working, 1);
+		while (atomic_load(&thpool_p->on_hold)){
+			thread_hold(thpool_p);
+		}
+
+		if (thpool_p->stats){
+			/* Dequeue stamp after the gate, a pause counts as waiting */
+			uint64_t start = clock_now_ns();
+			histogram_add(&thread_p->stats.wait, start - job_p->queued_ns);
+			thread_run_job(thpool_p, job_p);
+			uint64_t done = clock_now_ns();
+			histogram_add(&thread_p->stats.run, done - start);
+			counter_add(&thread_p->stats.busy_ns, done - start);
+		}
+		else {
+			thread_run_job(thpool_p, job_p);
+		}
+		atomic_fetch_sub(&thpool_p->num_threads_working, 1);
+
+		/* A pause may be waiting for this job */
+		if (atomic_load(&thpool_p->on_hold)){
+			pthread_mutex_lock(&thpool_p->hold_lock);
+			pthread_cond_broadcast(&thpool_p->hold_cond);
+			pthread_mutex_unlock(&thpool_p->hold_lock);
+		}
+	}
+	pthread_mutex_lock(&thpool_p->thcount_lock);
+	thpool_p->num_threads_alive --;
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
+
+	return NULL;
+}
+
+/* Execute a job and retire it
+ *
+ * @param thpool_p      pool the job was submitted to
+ * @param job_p         job taken out of the queue
+ */
+static void thread_run_job(thpool_* thpool_p, struct job* job_p){
+	/* Cancelled while queued -> already off the books, just free it */
+	thpool_group_* group_p = job_p->group;
+	if (group_p != NULL && group_claim(group_p, job_p) == -1){
+		slab_free(&thpool_p->jobqueue.slab, job_p);
+		group_put(group_p);
+		return;
+	}
+
+	void (*func_buff)(void*);
+	void*  arg_buff;
+	func_buff = job_p->function;
+	arg_buff  = job_p->arg;
+
+	/* Checked once the function returns, the job may be gone by then */
+	uint64_t deadline_ns = job_p->deadline_ns;
+	void (*task_p)(void*) = job_p->task;
+
+	/* Inline arguments live in the job, keep it until the function is done */
+	if (job_p->done != NULL){
+		func_buff(arg_buff);
+		thpool_job_complete(thpool_p, job_p);
+	}
+	else if (arg_buff == job_p->inline_args){
+		func_buff(arg_buff);
+		slab_free(&thpool_p->jobqueue.slab, job_p);
+	}
+	else {
+		slab_free(&thpool_p->jobqueue.slab, job_p);
+		func_buff(arg_buff);
+	}
+
+	if (deadline_ns){
+		deadline_account(thpool_p, task_p, deadline_ns, clock_now_ns());
+	}
+
+	if (group_p != NULL){
+		group_done(group_p, 1);
+		group_put(group_p);
+	}
+	group_done(&thpool_p->all, 1);
+}
+
+/* Pick the next job for a worker
+ *
+ * High priority and overdue jobs of the shared queue first, then the own
+ * deque (newest job, still hot in cache), then the rest of the shared
+ * queue, then steal the oldest job of each other worker in turn.
+ *
+ * @return job, or NULL if nothing could be found
+ */
+static struct job* thread_next_job(struct thread* thread_p){
+	thpool_* thpool_p = thread_p->thpool_p;
+
+	job* job_p = jobqueue_pull(&thpool_p->jobqueue, 1);
+	if (job_p != NULL){
+		return job_p;
+	}
+
+	job_p = jobdeque_take(&thread_p->deque);
+	if (job_p != NULL){
+		jobqueue_taken(&thpool_p->jobqueue, THPOOL_PRIO_NORMAL);
+		return job_p;
+	}
+
+	job_p = jobqueue_pull(&thpool_p->jobqueue, 0);
+	if (job_p != NULL){
+		return job_p;
+	}
+
+	int n;
+	for (n=1; n < thpool_p->num_threads; n++){
+		thread* victim = thpool_p->threads[(thread_p->id + n) % thpool_p->num_threads];
+		job_p = jobdeque_steal(&victim->deque);
+		if (job_p != NULL){
+			jobqueue_taken(&thpool_p->jobqueue, THPOOL_PRIO_NORMAL);
+			return job_p;
+		}
+	}
+
+	return NULL;
+}
+
+/* Busy-wait for a job before parking
+ *
+ * A futex sleep and wakeup costs tens of microseconds, more than the gap
+ * between jobs of a busy sampling loop. Watching the queue length for a
+ * little while lets the next job start without either, and producers
+ * skip the wakeup since a spinning worker doesn't count as idle.
+ *
+ * @param thread_p      worker going idle
+ * @param idle_ns       time it went idle
+ * @return 1 if there is work (or the pool is stopping), 0 to park
+ */
+static int thread_spin(struct thread* thread_p, uint64_t idle_ns){
+	thpool_* thpool_p = thread_p->thpool_p;
+	if (thread_p->spin_ns == 0){
+		return 0;
+	}
+
+	for (;;){
+		int n;
+		for (n=0; n<THPOOL_SPIN_CHECKS; n++){
+			if (atomic_load_explicit(&thpool_p->jobqueue.len, memory_order_relaxed) != 0
+			    || !atomic_load_explicit(&thpool_p->keepalive, memory_order_relaxed)){
+				return 1;
+			}
+			cpu_relax();
+		}
+		if (clock_now_ns() - idle_ns >= thread_p->spin_ns){
+			return 0;
+		}
+	}
+}
+
+/* Fold the last wait for a job into the worker's spin budget
+ *
+ * The budget is twice the running average of the waits while that stays
+ * under the limit, so a steady stream of jobs never parks, and drops to
+ * nothing once jobs come further apart than the limit, so a quiet pool
+ * doesn't burn CPU. Waits are clamped so one long idle spell doesn't
+ * keep the average up for long.
+ */
+static void thread_spin_update(struct thread* thread_p, uint64_t idle_ns){
+	uint64_t spin_max = thread_p->thpool_p->spin_max_ns;
+	if (idle_ns > 2 * spin_max){
+		idle_ns = 2 * spin_max;
+	}
+
+	/* avg += (sample - avg) / 8 */
+	thread_p->idle_avg_ns = thread_p->idle_avg_ns - thread_p->idle_avg_ns / 8 + idle_ns / 8;
+
+	uint64_t avg = thread_p->idle_avg_ns;
+	if (avg >= spin_max){
+		thread_p->spin_ns = 0;
+	}
+	else {
+		thread_p->spin_ns = 2 * avg < spin_max ? 2 * avg : spin_max;
+	}
+}
+
+/* Frees a thread and drops the jobs left in its deque */
+static void thread_destroy (thread* thread_p){
+	job* job_p;
+	while ((job_p = jobdeque_take(&thread_p->deque)) != NULL){
+		jobqueue_taken(&thread_p->thpool_p->jobqueue, THPOOL_PRIO_NORMAL);
+		thpool_job_discard(thread_p->thpool_p, job_p);
+	}
+	free(thread_p);
+}
+/* ============================= STATS ============================== */
+/* Add one sample, single writer so plain loads and stores will do */
+static void histogram_add(histogram* histogram_p, uint64_t value_ns){
+	int bucket;
+	if (value_ns < 4){
+		bucket = (int)value_ns;
+	}
+	else {
+		/* 4 linear steps per power of two */
+		int msb = 63 - __builtin_clzll(value_ns);
+		bucket = (msb - 1) * 4 + (int)((value_ns >> (msb - 2)) & 3);
+		if (bucket >= THPOOL_HIST_BUCKETS){
+			bucket = THPOOL_HIST_BUCKETS - 1;
+		}
+	}
+	counter_add(&histogram_p->buckets[bucket], 1);
+	counter_add(&histogram_p->count, 1);
+	counter_add(&histogram_p->sum_ns, value_ns);
+	if (value_ns > atomic_load_explicit(&histogram_p->max_ns, memory_order_relaxed)){
+		atomic_store_explicit(&histogram_p->max_ns, value_ns, memory_order_relaxed);
+	}
+}
+
+/* Add a worker's histogram into a snapshot */
+static void histogram_read(const histogram* histogram_p, thpool_histogram* out_p){
+	out_p->count  += atomic_load_explicit(&histogram_p->count, memory_order_relaxed);
+	out_p->sum_ns += atomic_load_explicit(&histogram_p->sum_ns, memory_order_relaxed);
+	uint64_t max_ns = atomic_load_explicit(&histogram_p->max_ns, memory_order_relaxed);
+	if (max_ns > out_p->max_ns){
+		out_p->max_ns = max_ns;
+	}
+	int n;
+	for (n=0; n < THPOOL_HIST_BUCKETS; n++){
+		out_p->buckets[n] += atomic_load_explicit(&histogram_p->buckets[n], memory_order_relaxed);
+	}
+}
+
+/* Single writer increment, no locked instruction needed */
+static void counter_add(atomic_uint_least64_t* counter_p, uint64_t value){
+	atomic_store_explicit(counter_p, atomic_load_explicit(counter_p, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+/* Count a finished deadline job in the pool total and under its task */
+static void deadline_account(thpool_* thpool_p, void (*task_p)(void*), uint64_t deadline_ns, uint64_t done_ns){
+	uint64_t late_ns = done_ns > deadline_ns ? done_ns - deadline_ns : 0;
+	if (late_ns){
+		atomic_fetch_add_explicit(&thpool_p->num_deadline_missed, 1, memory_order_relaxed);
+	}
+
+	deadline_task* task = deadline_lookup(thpool_p, task_p, 1);
+	if (task == NULL){
+		return;
+	}
+	atomic_fetch_add_explicit(&task->num_runs, 1, memory_order_relaxed);
+	if (late_ns){
+		atomic_fetch_add_explicit(&task->num_missed, 1, memory_order_relaxed);
+		uint64_t max_late = atomic_load_explicit(&task->max_late_ns, memory_order_relaxed);
+		while (late_ns > max_late
+		       && !atomic_compare_exchange_weak_explicit(&task->max_late_ns, &max_late, late_ns,
+		                                                 memory_order_relaxed, memory_order_relaxed)){
+		}
+	}
+}
+
+/* Find the counters of a task, linear probing from its hash
+ *
+ * Entries are never given back, so an empty one ends the search.
+ *
+ * @param create        claim the empty entry for a task not seen yet
+ * @return entry, or NULL if not found or the table is full
+ */
+static deadline_task* deadline_lookup(thpool_* thpool_p, void (*task_p)(void*), int create){
+	uintptr_t key = (uintptr_t)task_p;
+	uintptr_t hash = (key >> 4) ^ (key >> 12);
+	int n;
+	for (n=0; n<THPOOL_DEADLINE_TASKS; n++){
+		deadline_task* task = &thpool_p->deadlines[(hash + n) & (THPOOL_DEADLINE_TASKS - 1)];
+		uintptr_t owner = atomic_load(&task->function);
+		if (owner == 0){
+			if (!create){
+				return NULL;
+			}
+			if (atomic_compare_exchange_strong(&task->function, &owner, key)){
+				return task;
+			}
+		}
+		if (owner == key){
+			return task;
+		}
+	}
+	return NULL;
+}
+
+/* ========================== PARALLEL FOR ========================== */
+/* Helper job of thpool_parallel_for() */
+static void parallel_for_run(void* arg){
+	parallel_for* pf_p = (struct parallel_for*)arg;
+	parallel_for_work(pf_p);
+	parallel_for_put(pf_p);
+}
+
+/* Claim and run chunks until the range is used up
+ *
+ * Chunks start large and shrink as the range drains (guided scheduling):
+ * each claim takes the remaining size split over twice the participants,
+ * but never less than grain, so late chunks even out the load.
+ */
+static void parallel_for_work(parallel_for* pf_p){
+	long begin = atomic_load_explicit(&pf_p->next, memory_order_relaxed);
+
+	for (;;){
+		long left = pf_p->end - begin;
+		if (left <= 0){
+			return;
+		}
+		long size = left / (2L * pf_p->num_workers);
+		if (size < pf_p->grain){
+			size = pf_p->grain;
+		}
+		if (size > left){
+			size = left;
+		}
+		if (!atomic_compare_exchange_weak_explicit(&pf_p->next, &begin, begin + size,
+		                                           memory_order_relaxed, memory_order_relaxed)){
+			continue;
+		}
+
+		pf_p->function(begin, begin + size, pf_p->ctx);
+
+		/* Last chunk done -> wake the caller if it is already waiting */
+		if (atomic_fetch_sub(&pf_p->num_left, size) == size && atomic_load(&pf_p->num_waiters)){
+			pthread_mutex_lock(&pf_p->mutex);
+			pthread_cond_broadcast(&pf_p->cond);
+			pthread_mutex_unlock(&pf_p->mutex);
+		}
+
+		begin = atomic_load_explicit(&pf_p->next, memory_order_relaxed);
+	}
+}
+
+/* Drop a reference, the last one frees the range */
+static void parallel_for_put(parallel_for* pf_p){
+	if (atomic_fetch_sub(&pf_p->refs, 1) != 1){
+		return;
+	}
+	pthread_mutex_destroy(&pf_p->mutex);
+	pthread_cond_destroy(&pf_p->cond);
+	free(pf_p);
+}
+
+/* =========================== TASK GRAPH =========================== */
+/* Collect the roots and make sure every node can be reached (no cycles)
+ *
+ * Kahn's algorithm over a copy of the predecessor counts.
+ *
+ * @return 0 on success, -1 if the graph has a cycle or memory ran out
+ */
+static int graph_seal(thpool_graph_* graph_p){
+	int num_nodes = graph_p->num_nodes;
+	int* order = (int*)malloc(num_nodes * sizeof(int));
+	int* left  = (int*)malloc(num_nodes * sizeof(int));
+	if (order == NULL || left == NULL){
+		err("thpool_graph_run(): Could not allocate memory\n");
+		free(order);
+		free(left);
+		return -1;
+	}
+
+	int num_roots = 0;
+	int n;
+	for (n=0; n<num_nodes; n++){
+		left[n] = graph_p->nodes[n].num_predecessors;
+		if (left[n] == 0){
+			order[num_roots++] = n;
+		}
+	}
+
+	/* order doubles as the work list */
+	int num_ordered = num_roots;
+	int i;
+	for (i=0; i<num_ordered; i++){
+		graph_node* node_p = &graph_p->nodes[order[i]];
+		int s;
+		for (s=0; s<node_p->num_successors; s++){
+			if (--left[node_p->successors[s]] == 0){
+				order[num_ordered++] = node_p->successors[s];
+			}
+		}
+	}
+	free(left);
+
+	if (num_ordered != num_nodes){
+		err("thpool_graph_run(): Graph has a cycle\n");
+		free(order);
+		return -1;
+	}
+
+	/* The roots are the first num_roots entries */
+	free(graph_p->roots);
+	graph_p->roots     = order;
+	graph_p->num_roots = num_roots;
+	graph_p->sealed    = 1;
+	return 0;
+}
+
+/* Run a node, then carry on with one of the successors it released */
+static void graph_node_run(void* arg){
+	graph_node* node_p = (struct graph_node*)arg;
+	while (node_p != NULL){
+		node_p->function(node_p->arg);
+		node_p = graph_release(node_p);
+	}
+}
+
+/* Count a node as done and release the successors that became ready
+ *
+ * All but one of the ready successors are queued (from a worker they
+ * go onto its own deque for others to steal), the one returned runs on
+ * this thread right away without a trip through the queue.
+ *
+ * @return successor to run next, or NULL
+ */
+static graph_node* graph_release(graph_node* node_p){
+	thpool_graph_* graph_p = node_p->graph_p;
+	graph_node* next_p = NULL;
+
+	int s;
+	for (s=0; s<node_p->num_successors; s++){
+		graph_node* succ_p = &graph_p->nodes[node_p->successors[s]];
+		if (atomic_fetch_sub(&succ_p->num_left, 1) != 1){
+			continue;
+		}
+		if (next_p == NULL){
+			next_p = succ_p;
+		}
+		else if (thpool_add_work(graph_p->thpool_p, graph_node_run, succ_p) == -1){
+			graph_node_run(succ_p);
+		}
+	}
+
+	/* Last node of the run -> wake the caller */
+	if (atomic_fetch_sub(&graph_p->num_left, 1) == 1){
+		pthread_mutex_lock(&graph_p->mutex);
+		graph_p->finished = 1;
+		pthread_cond_broadcast(&graph_p->cond);
+		pthread_mutex_unlock(&graph_p->mutex);
+	}
+	return next_p;
+}
+
+/* ============================= FIBER ============================== */
+/* First code a fiber runs, on its own stack */
+static void fiber_main(void){
+	fiber* fiber_p = fiber_self;
+	fiber_p->function(fiber_p->arg);
+	fiber_switch(fiber_p, FIBER_DONE);
+}
+
+/* Job that resumes a fiber until it switches out for good or for a while
+ *
+ * Whatever the fiber switched out for (queue it again, start its timer,
+ * watch its fd) is only done here, back on the worker's stack, so no
+ * other worker can resume it while it is still running.
+ */
+static void fiber_run(void* arg){
+	fiber* fiber_p = (struct fiber*)arg;
+	/* A fiber may run jobs itself (caller-runs), resume inside it */
+	fiber* outer = fiber_self;
+	do {
+		fiber_self = fiber_p;
+		fiber_p->park = FIBER_RUNNING;
+		swapcontext(&fiber_p->caller, &fiber_p->context);
+		fiber_self = outer;
+	} while (fiber_park_done(fiber_p));
+}
+
+/* Switch from the fiber back to the worker that resumed it */
+static void fiber_switch(fiber* fiber_p, fiber_park park){
+	fiber_p->park = park;
+	swapcontext(&fiber_p->context, &fiber_p->caller);
+}
+
+/* Arrange for a fiber that switched out to be resumed
+ *
+ * The fiber must not be touched after it was handed on.
+ *
+ * @return 1 to resume it right away (could not be handed on), 0 otherwise
+ */
+static int fiber_park_done(fiber* fiber_p){
+	thpool_* thpool_p = fiber_p->thpool_p;
+
+	switch (fiber_p->park){
+	case FIBER_YIELD:
+		return thpool_add_work(thpool_p, fiber_run, fiber_p) == -1;
+
+	case FIBER_SLEEP: {
+		thpool_timer_* timer_p = timer_schedule(thpool_p, fiber_p->park_ms, 0, fiber_run, fiber_p);
+		if (timer_p != NULL){
+			timer_put(timer_p);
+			return 0;
+		}
+		/* No timer while the pool is going away, stay parked until
+		 * thpool_destroy frees the fiber. Resuming it would only spin
+		 * a sleep loop until then */
+		pthread_mutex_lock(&thpool_p->timers.lock);
+		int stopped = thpool_p->timers.stop;
+		pthread_mutex_unlock(&thpool_p->timers.lock);
+		if (stopped){
+			return 0;
+		}
+		/* Otherwise the sleep fails */
+		fiber_p->revents = -1;
+		return 1;
+	}
+
+	case FIBER_WAIT_FD:
+		if (fiberpoll_add(thpool_p, fiber_p) == -1){
+			fiber_p->revents = -1;
+			return 1;
+		}
+		return 0;
+
+	default:
+		fiber_free(fiber_p);
+		return 0;
+	}
+}
+
+/* Unlink a fiber from its pool and free its stack */
+static void fiber_free(fiber* fiber_p){
+	fiberpoll* poll_p = &fiber_p->thpool_p->fibers;
+	pthread_mutex_lock(&poll_p->lock);
+	if (fiber_p->prev != NULL){
+		fiber_p->prev->next = fiber_p->next;
+	}
+	else {
+		poll_p->fibers = fiber_p->next;
+	}
+	if (fiber_p->next != NULL){
+		fiber_p->next->prev = fiber_p->prev;
+	}
+	pthread_mutex_unlock(&poll_p->lock);
+
+	munmap(fiber_p->stack, fiber_p->stack_size);
+	free(fiber_p);
+}
+
+/* Initialize the fiber list, the poller starts with the first fd wait */
+static void fiberpoll_init(fiberpoll* poll_p){
+	pthread_mutex_init(&poll_p->lock, NULL);
+	poll_p->fibers  = NULL;
+	poll_p->started = 0;
+	poll_p->stopped = 0;
+	poll_p->epfd    = -1;
+	poll_p->stopfd  = -1;
+}
+
+/* Create the epoll set and the thread waiting on it, called with the lock held */
+static int fiberpoll_start(thpool_* thpool_p){
+	fiberpoll* poll_p = &thpool_p->fibers;
+
+	poll_p->epfd   = epoll_create1(EPOLL_CLOEXEC);
+	poll_p->stopfd = eventfd(0, EFD_CLOEXEC);
+	if (poll_p->epfd == -1 || poll_p->stopfd == -1){
+		err("fiberpoll_start(): Could not create epoll set\n");
+		goto fail;
+	}
+
+	/* A NULL fiber tells the thread to stop */
+	struct epoll_event ev;
+	ev.events   = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(poll_p->epfd, EPOLL_CTL_ADD, poll_p->stopfd, &ev) == -1
+	    || pthread_create(&poll_p->thread, NULL, (void * (*)(void *)) fiberpoll_do, thpool_p) != 0){
+		err("fiberpoll_start(): Could not create fiber poll thread\n");
+		goto fail;
+	}
+	poll_p->started = 1;
+	return 0;
+
+fail:
+	if (poll_p->epfd != -1) close(poll_p->epfd);
+	if (poll_p->stopfd != -1) close(poll_p->stopfd);
+	poll_p->epfd   = -1;
+	poll_p->stopfd = -1;
+	return -1;
+}
+
+/* Watch the fd a fiber waits on, one shot
+ *
+ * Once the pool is being destroyed the fiber is left parked, it is freed
+ * with the pool.
+ *
+ * @return 0 on success, -1 if the fd can't be watched (or already is)
+ */
+static int fiberpoll_add(thpool_* thpool_p, fiber* fiber_p){
+	fiberpoll* poll_p = &thpool_p->fibers;
+
+	pthread_mutex_lock(&poll_p->lock);
+	if (poll_p->stopped){
+		pthread_mutex_unlock(&poll_p->lock);
+		return 0;
+	}
+	if (!poll_p->started && fiberpoll_start(thpool_p) == -1){
+		pthread_mutex_unlock(&poll_p->lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&poll_p->lock);
+
+	struct epoll_event ev;
+	ev.events   = (uint32_t)fiber_p->park_events | EPOLLONESHOT;
+	ev.data.ptr = fiber_p;
+	return epoll_ctl(poll_p->epfd, EPOLL_CTL_ADD, fiber_p->park_fd, &ev);
+}
+
+/* Queue fibers whose fd became ready */
+static void* fiberpoll_do(thpool_* thpool_p){
+	fiberpoll* poll_p = &thpool_p->fibers;
+
+	char thread_name[32] = {0};
+	snprintf(thread_name, sizeof(thread_name), "%s-fib", thpool_p->name);
+	prctl(PR_SET_NAME, thread_name);
+
+	fiberpoll_self = thpool_p;
+
+	/* Fibers that could not be queued, tried again every retry period.
+	 * Left parked when the pool stops, thpool_destroy frees them */
+	fiber* pending = NULL;
+
+	struct epoll_event events[THPOOL_FIBER_EVENTS];
+	for (;;){
+		int num_events = epoll_wait(poll_p->epfd, events, THPOOL_FIBER_EVENTS,
+		                            pending != NULL ? THPOOL_FIBER_RETRY_MS : -1);
+		if (num_events == -1){
+			if (errno == EINTR){
+				continue;
+			}
+			err("fiberpoll_do(): Could not wait on epoll set\n");
+			break;
+		}
+
+		fiber* retry = pending;
+		pending = NULL;
+		while (retry != NULL){
+			fiber* next = retry->pending_next;
+			fiberpoll_resume(thpool_p, retry, &pending);
+			retry = next;
+		}
+
+		int n;
+		for (n=0; n<num_events; n++){
+			fiber* fiber_p = (struct fiber*)events[n].data.ptr;
+			if (fiber_p == NULL){
+				return NULL;
+			}
+			/* Off the set before the fiber can wait on the fd again */
+			epoll_ctl(poll_p->epfd, EPOLL_CTL_DEL, fiber_p->park_fd, NULL);
+			fiber_p->revents = (int)events[n].events;
+			fiberpoll_resume(thpool_p, fiber_p, &pending);
+		}
+	}
+	return NULL;
+}
+
+/* Queue a woken fiber for the workers, or put it on pending to retry
+ *
+ * The poller never runs a fiber itself, that would stall every other
+ * fiber waiting on an fd and run it outside any worker.
+ */
+static void fiberpoll_resume(thpool_* thpool_p, fiber* fiber_p, fiber** pending_p){
+	if (thpool_add_work(thpool_p, fiber_run, fiber_p) == -1){
+		fiber_p->pending_next = *pending_p;
+		*pending_p = fiber_p;
+	}
+}
+
+/* Stop the poll thread, no fiber is woken by its fd after this */
+static void fiberpoll_stop(fiberpoll* poll_p){
+	pthread_mutex_lock(&poll_p->lock);
+	int started = poll_p->started;
+	poll_p->started = 0;
+	poll_p->stopped = 1;
+	pthread_mutex_unlock(&poll_p->lock);
+
+	if (started){
+		eventfd_write(poll_p->stopfd, 1);
+		pthread_join(poll_p->thread, NULL);
+		close(poll_p->epfd);
+		close(poll_p->stopfd);
+		poll_p->epfd   = -1;
+		poll_p->stopfd = -1;
+	}
+}
+
+/* Free the fibers that never finished, the workers are gone by now */
+static void fiberpoll_destroy(fiberpoll* poll_p){
+	while (poll_p->fibers != NULL){
+		fiber_free(poll_p->fibers);
+	}
+	pthread_mutex_destroy(&poll_p->lock);
+}
+
+/* ============================= FUTURE ============================= */
+/* Job trampoline, runs the function and publishes its result */
+static void future_run(void* arg){
+	thpool_future_* future_p = (struct thpool_future_*)arg;
+
+	future_p->result = future_p->function(future_p->arg);
+	atomic_store(&future_p->done, 1);
+
+	/* Only take the lock when somebody is actually waiting */
+	if (atomic_load(&future_p->num_waiters)){
+		pthread_mutex_lock(&future_p->mutex);
+		pthread_cond_broadcast(&future_p->cond);
+		pthread_mutex_unlock(&future_p->mutex);
+	}
+
+	future_put(future_p);
+}
+
+/* Drop a reference, the last one returns the handle to the slab */
+static void future_put(thpool_future_* future_p){
+	if (atomic_fetch_sub(&future_p->refs, 1) != 1){
+		return;
+	}
+	slab* slab_p = &future_p->thpool_p->future_slab;
+	if (!slab_owns(slab_p, future_p)){
+		future_sync_destroy(future_p);
+	}
+	slab_free(slab_p, future_p);
+}
+
+/* Set up a handle's mutex and condvar, once per slab slot
+ *
+ * Monotonic clock so wait_timeout isn't thrown off by date changes.
+ */
+static void future_sync_init(thpool_future_* future_p){
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&future_p->mutex, NULL);
+	pthread_cond_init(&future_p->cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* Tear down a handle's mutex and condvar */
+static void future_sync_destroy(thpool_future_* future_p){
+	pthread_mutex_destroy(&future_p->mutex);
+	pthread_cond_destroy(&future_p->cond);
+}
+
+/* =========================== JOB GROUP ============================ */
+/* Initialize an empty group, held by its creator */
+static void group_init(thpool_group_* group_p, thpool_* thpool_p){
+	group_p->thpool_p = thpool_p;
+	group_p->jobs     = NULL;
+	atomic_init(&group_p->num_pending, 0);
+	atomic_init(&group_p->refs, 1);
+	pthread_mutex_init(&group_p->mutex, NULL);
+	pthread_cond_init(&group_p->cond, NULL);
+}
+
+/* Count a new job in the group and link it for thpool_cancel_group() */
+static void group_attach(thpool_group_* group_p, struct job* job_p){
+	job_p->group      = group_p;
+	atomic_fetch_add(&group_p->refs, 1);
+	atomic_fetch_add(&group_p->num_pending, 1);
+
+	pthread_mutex_lock(&group_p->mutex);
+	job_p->group_next = group_p->jobs;
+	if (group_p->jobs != NULL){
+		group_p->jobs->group_prev = job_p;
+	}
+	group_p->jobs = job_p;
+	pthread_mutex_unlock(&group_p->mutex);
+}
+
+/* Take a job off the group's list before it runs or is dropped
+ *
+ * @return 0 if the job is ours, -1 if thpool_cancel_group() got it first
+ */
+static int group_claim(thpool_group_* group_p, struct job* job_p){
+	int rc = 0;
+	pthread_mutex_lock(&group_p->mutex);
+	if (job_p->cancelled){
+		rc = -1;
+	}
+	else {
+		if (job_p->group_prev != NULL){
+			job_p->group_prev->group_next = job_p->group_next;
+		}
+		else {
+			group_p->jobs = job_p->group_next;
+		}
+		if (job_p->group_next != NULL){
+			job_p->group_next->group_prev = job_p->group_prev;
+		}
+	}
+	pthread_mutex_unlock(&group_p->mutex);
+	return rc;
+}
+
+/* Count jobs as finished, the last outstanding one wakes the waiters */
+static void group_done(thpool_group_* group_p, int num_jobs){
+	if (atomic_fetch_sub(&group_p->num_pending, num_jobs) == num_jobs){
+		pthread_mutex_lock(&group_p->mutex);
+		pthread_cond_broadcast(&group_p->cond);
+		pthread_mutex_unlock(&group_p->mutex);
+	}
+}
+
+/* Wait until nothing is pending in the group */
+static void group_wait(thpool_group_* group_p){
+	pthread_mutex_lock(&group_p->mutex);
+	while (atomic_load(&group_p->num_pending)) {
+		pthread_cond_wait(&group_p->cond, &group_p->mutex);
+	}
+	pthread_mutex_unlock(&group_p->mutex);
+}
+
+/* Drop a reference, the last one frees the group */
+static void group_put(thpool_group_* group_p){
+	if (atomic_fetch_sub(&group_p->refs, 1) == 1){
+		group_destroy(group_p);
+		free(group_p);
+	}
+}
+
+/* Free a group's synchronisation objects */
+static void group_destroy(thpool_group_* group_p){
+	pthread_mutex_destroy(&group_p->mutex);
+	pthread_cond_destroy(&group_p->cond);
+}
+
+/* ========================== TIMER WHEEL =========================== */
+/* Initialize an empty wheel, the thread starts with the first timer */
+static void timerwheel_init(timerwheel* wheel_p){
+	memset(wheel_p->slots, 0, sizeof(wheel_p->slots));
+	pthread_mutex_init(&wheel_p->lock, NULL);
+	wheel_p->started    = 0;
+	wheel_p->fd         = -1;
+	wheel_p->stop       = 0;
+	wheel_p->base_ns    = clock_now_ns();
+	wheel_p->now        = 0;
+	wheel_p->armed      = 0;
+	wheel_p->num_timers = 0;
+}
+
+/* Create the timerfd and the dispatch thread, called with the lock held
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int timerwheel_start(thpool_* thpool_p){
+	timerwheel* wheel_p = &thpool_p->timers;
+
+	wheel_p->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (wheel_p->fd == -1){
+		err("timerwheel_start(): Could not create timerfd\n");
+		return -1;
+	}
+
+	/* Nothing happened since init, start counting ticks now */
+	wheel_p->base_ns = clock_now_ns();
+	wheel_p->now     = 0;
+
+	if (pthread_create(&wheel_p->thread, NULL, (void * (*)(void *)) timerwheel_do, thpool_p) != 0){
+		err("timerwheel_start(): Could not create timer thread\n");
+		close(wheel_p->fd);
+		wheel_p->fd = -1;
+		return -1;
+	}
+	wheel_p->started = 1;
+	return 0;
+}
+
+/* Link a timer into the slot its expiry falls in, called with the lock held
+ *
+ * Level n holds timers due within 64^(n+1) ticks, indexed by bits
+ * 6n..6n+5 of the expiry tick. Timers further out than the top level wait
+ * in its farthest slot and get placed again when it cascades.
+ */
+static void timerwheel_add(timerwheel* wheel_p, thpool_timer_* timer_p){
+	uint64_t delta = timer_p->expires > wheel_p->now ? timer_p->expires - wheel_p->now : 0;
+	uint64_t expires = timer_p->expires;
+
+	int level;
+	for (level=0; level < THPOOL_WHEEL_LEVELS - 1; level++){
+		if (delta < (1ULL << (THPOOL_WHEEL_BITS * (level + 1)))){
+			break;
+		}
+	}
+	if (delta >= (1ULL << (THPOOL_WHEEL_BITS * THPOOL_WHEEL_LEVELS))){
+		expires = wheel_p->now + (1ULL << (THPOOL_WHEEL_BITS * THPOOL_WHEEL_LEVELS)) - 1;
+	}
+
+	thpool_timer_** slot_p = &wheel_p->slots[level][(expires >> (THPOOL_WHEEL_BITS * level)) & THPOOL_WHEEL_MASK];
+	timer_p->prev = NULL;
+	timer_p->next = *slot_p;
+	if (*slot_p != NULL){
+		(*slot_p)->prev = timer_p;
+	}
+	*slot_p = timer_p;
+	timer_p->slot   = slot_p;
+	timer_p->queued = 1;
+	wheel_p->num_timers++;
+}
+
+/* Unlink a queued timer from its slot, called with the lock held */
+static void timerwheel_remove(timerwheel* wheel_p, thpool_timer_* timer_p){
+	if (timer_p->prev != NULL){
+		timer_p->prev->next = timer_p->next;
+	}
+	else {
+		*timer_p->slot = timer_p->next;
+	}
+	if (timer_p->next != NULL){
+		timer_p->next->prev = timer_p->prev;
+	}
+	timer_p->next   = NULL;
+	timer_p->prev   = NULL;
+	timer_p->queued = 0;
+	wheel_p->num_timers--;
+}
+
+/* Make the timerfd fire at the given tick, 0 disarms it */
+static void timerwheel_arm(timerwheel* wheel_p, uint64_t tick){
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (tick != 0){
+		uint64_t at_ns = wheel_p->base_ns + tick * THPOOL_TIMER_TICK_NS;
+		its.it_value.tv_sec  = at_ns / 1000000000ULL;
+		its.it_value.tv_nsec = at_ns % 1000000000ULL;
+	}
+	wheel_p->armed = tick;
+	if (timerfd_settime(wheel_p->fd, TFD_TIMER_ABSTIME, &its, NULL) == -1){
+		err("timerwheel_arm(): Could not set timerfd\n");
+	}
+}
+
+/* Earliest tick the thread has to look at again, 0 if the wheel is empty
+ *
+ * The first busy level 0 slot, or the next cascade boundary when the
+ * rest of this round is empty. Called with the lock held.
+ */
+static uint64_t timerwheel_next(timerwheel* wheel_p){
+	if (wheel_p->num_timers == 0){
+		return 0;
+	}
+	uint64_t boundary = (wheel_p->now | THPOOL_WHEEL_MASK) + 1;
+	uint64_t tick;
+	for (tick = wheel_p->now + 1; tick < boundary; tick++){
+		if (wheel_p->slots[0][tick & THPOOL_WHEEL_MASK] != NULL){
+			return tick;
+		}
+	}
+	return boundary;
+}
+
+/* Current tick since base_ns */
+static uint64_t timerwheel_tick(timerwheel* wheel_p){
+	return (clock_now_ns() - wheel_p->base_ns) / THPOOL_TIMER_TICK_NS;
+}
+
+/* Timer thread, advances the wheel and queues expired timers as jobs */
+static void* timerwheel_do(thpool_* thpool_p){
+	timerwheel* wheel_p = &thpool_p->timers;
+
+	char thread_name[32] = {0};
+	snprintf(thread_name, sizeof(thread_name), "%s-tmr", thpool_p->name);
+	prctl(PR_SET_NAME, thread_name);
+
+	for (;;){
+		uint64_t expirations;
+		if (read(wheel_p->fd, &expirations, sizeof(expirations)) == -1 && errno != EINTR){
+			err("timerwheel_do(): Could not read timerfd\n");
+			break;
+		}
+
+		thpool_timer_* fired = NULL;
+		pthread_mutex_lock(&wheel_p->lock);
+		if (wheel_p->stop){
+			pthread_mutex_unlock(&wheel_p->lock);
+			break;
+		}
+
+		uint64_t target = timerwheel_tick(wheel_p);
+		if (wheel_p->num_timers == 0 && target > wheel_p->now){
+			wheel_p->now = target;
+		}
+		while (wheel_p->now < target){
+			wheel_p->now++;
+			uint64_t now = wheel_p->now;
+
+			/* Cascade every level whose lower neighbour just wrapped */
+			int level;
+			for (level=1; level < THPOOL_WHEEL_LEVELS; level++){
+				if ((now & ((1ULL << (THPOOL_WHEEL_BITS * level)) - 1)) != 0){
+					break;
+				}
+				thpool_timer_** slot_p = &wheel_p->slots[level][(now >> (THPOOL_WHEEL_BITS * level)) & THPOOL_WHEEL_MASK];
+				thpool_timer_* timer_p = *slot_p;
+				*slot_p = NULL;
+				while (timer_p != NULL){
+					thpool_timer_* next = timer_p->next;
+					wheel_p->num_timers--;
+					timerwheel_add(wheel_p, timer_p);
+					timer_p = next;
+				}
+			}
+
+			/* Everything in this slot is due */
+			thpool_timer_** slot_p = &wheel_p->slots[0][now & THPOOL_WHEEL_MASK];
+			thpool_timer_* timer_p = *slot_p;
+			*slot_p = NULL;
+			while (timer_p != NULL){
+				thpool_timer_* next = timer_p->next;
+				wheel_p->num_timers--;
+				timer_p->queued = 0;
+				if (timer_p->expires > now){
+					/* Parked in the top level, not due yet */
+					timerwheel_add(wheel_p, timer_p);
+				}
+				else {
+					/* One shots hand the wheel's reference to the job. Periodic
+					 * ones skip runs missed while catching up, so they show up
+					 * on the fired list once */
+					if (timer_p->period){
+						atomic_fetch_add(&timer_p->refs, 1);
+						while (timer_p->expires <= target){
+							timer_p->expires += timer_p->period;
+						}
+						timerwheel_add(wheel_p, timer_p);
+					}
+					/* Periodic runs have to be done by the next release */
+					timer_p->fire_deadline_ns = timer_p->period && thpool_p->jobqueue.type == THPOOL_QUEUE_EDF
+					                          ? wheel_p->base_ns + timer_p->expires * THPOOL_TIMER_TICK_NS : 0;
+					timer_p->fire_next = fired;
+					fired = timer_p;
+				}
+				timer_p = next;
+			}
+		}
+
+		timerwheel_arm(wheel_p, timerwheel_next(wheel_p));
+		pthread_mutex_unlock(&wheel_p->lock);
+
+		/* Queue outside the lock, adding work may block on a full ring */
+		while (fired != NULL){
+			thpool_timer_* timer_p = fired;
+			fired = timer_p->fire_next;
+
+			/* A periodic run still queued or running -> skip this one */
+			if (timer_p->period && atomic_exchange(&timer_p->running, 1)){
+				timer_put(timer_p);
+				continue;
+			}
+			if (thpool_push_deadline(thpool_p, timer_run, timer_p, timer_p->fire_deadline_ns, timer_p->function) == -1){
+				atomic_store(&timer_p->running, 0);
+				timer_put(timer_p);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Stop the thread and drop every timer still in the wheel */
+static void timerwheel_destroy(timerwheel* wheel_p){
+	/* No timer can be scheduled after this */
+	pthread_mutex_lock(&wheel_p->lock);
+	wheel_p->stop = 1;
+	int started = wheel_p->started;
+	if (started){
+		/* Fire right away so the thread sees stop */
+		struct itimerspec its;
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_nsec = 1;
+		timerfd_settime(wheel_p->fd, 0, &its, NULL);
+	}
+	pthread_mutex_unlock(&wheel_p->lock);
+
+	if (started){
+		pthread_join(wheel_p->thread, NULL);
+		close(wheel_p->fd);
+		wheel_p->fd      = -1;
+		wheel_p->started = 0;
+	}
+
+	int level, n;
+	for (level=0; level < THPOOL_WHEEL_LEVELS; level++){
+		for (n=0; n < THPOOL_WHEEL_SIZE; n++){
+			thpool_timer_* timer_p = wheel_p->slots[level][n];
+			wheel_p->slots[level][n] = NULL;
+			while (timer_p != NULL){
+				thpool_timer_* next = timer_p->next;
+				timer_p->queued = 0;
+				atomic_store(&timer_p->cancelled, 1);
+				timer_put(timer_p);
+				timer_p = next;
+			}
+		}
+	}
+	wheel_p->num_timers = 0;
+}
+
+/* Create a timer and link it into the wheel
+ *
+ * @param delay_ms      time until the first run
+ * @param period_ms     time between runs, 0 for a one shot
+ * @return handle, or NULL on error
+ */
+static thpool_timer_* timer_schedule(thpool_* thpool_p, int delay_ms, int period_ms,
+                                     void (*function_p)(void*), void* arg_p){
+	thpool_timer_* timer_p = (struct thpool_timer_*)malloc(sizeof(struct thpool_timer_));
+	if (timer_p == NULL){
+		err("thpool_schedule(): Could not allocate memory for timer\n");
+		return NULL;
+	}
+	timer_p->thpool_p  = thpool_p;
+	timer_p->function  = function_p;
+	timer_p->arg       = arg_p;
+	timer_p->next      = NULL;
+	timer_p->prev      = NULL;
+	timer_p->slot      = NULL;
+	timer_p->fire_next = NULL;
+	timer_p->queued    = 0;
+	timer_p->period    = (uint64_t)(period_ms > 0 ? period_ms : 0) * 1000000ULL / THPOOL_TIMER_TICK_NS;
+	atomic_init(&timer_p->refs, 2);
+	atomic_init(&timer_p->cancelled, 0);
+	atomic_init(&timer_p->running, 0);
+
+	/* Round up, a timer never fires early */
+	uint64_t delay = ((uint64_t)(delay_ms > 0 ? delay_ms : 0) * 1000000ULL + THPOOL_TIMER_TICK_NS - 1) / THPOOL_TIMER_TICK_NS;
+
+	timerwheel* wheel_p = &thpool_p->timers;
+	pthread_mutex_lock(&wheel_p->lock);
+	if (wheel_p->stop || (!wheel_p->started && timerwheel_start(thpool_p) == -1)){
+		pthread_mutex_unlock(&wheel_p->lock);
+		free(timer_p);
+		return NULL;
+	}
+
+	/* An empty wheel may be far behind, nothing to catch up on */
+	uint64_t tick = timerwheel_tick(wheel_p);
+	if (wheel_p->num_timers == 0 && tick > wheel_p->now){
+		wheel_p->now = tick;
+	}
+
+	/* Relative to the current time, the thread may be a few ticks behind */
+	timer_p->expires = tick + (delay > 0 ? delay : 1);
+	if (timer_p->expires <= wheel_p->now){
+		timer_p->expires = wheel_p->now + 1;
+	}
+	timerwheel_add(wheel_p, timer_p);
+
+	/* Fire earlier if this is the new first timer */
+	if (wheel_p->armed == 0 || timer_p->expires < wheel_p->armed){
+		timerwheel_arm(wheel_p, timer_p->expires);
+	}
+	pthread_mutex_unlock(&wheel_p->lock);
+
+	return timer_p;
+}
+
+/* Job trampoline for an expired timer */
+static void timer_run(void* arg){
+	thpool_timer_* timer_p = (struct thpool_timer_*)arg;
+
+	if (!atomic_load(&timer_p->cancelled)){
+		timer_p->function(timer_p->arg);
+	}
+	atomic_store(&timer_p->running, 0);
+
+	timer_put(timer_p);
+}
+
+/* Drop a reference, the last one frees the timer */
+static void timer_put(thpool_timer_* timer_p){
+	if (atomic_fetch_sub(&timer_p->refs, 1) != 1){
+		return;
+	}
+	free(timer_p);
+}
+
+/* ============================ JOB QUEUE =========================== */
+/* Set every field of a job fresh from the slab, creators add what differs */
+static void job_init(struct job* job_p, void (*function_p)(void*), void* arg_p, int prio){
+	job_p->prev        = NULL;
+	job_p->function    = function_p;
+	job_p->arg         = arg_p;
+	job_p->done        = NULL;
+	job_p->queued_ns   = 0;
+	job_p->group       = NULL;
+	job_p->group_next  = NULL;
+	job_p->group_prev  = NULL;
+	job_p->cancelled   = 0;
+	job_p->deadline_ns = 0;
+	job_p->task        = function_p;
+	job_p->seq         = 0;
+	job_p->heap_index  = -1;
+	job_p->prio        = prio;
+}
+
+/* Initialize queue */
+static int jobqueue_init(jobqueue* jobqueue_p, const thpool_config* config){
+	jobqueue_p->type  = config->queue_type;
+	jobqueue_p->seq   = 0;
+	atomic_init(&jobqueue_p->len, 0);
+	atomic_init(&jobqueue_p->len_max, 0);
+	atomic_init(&jobqueue_p->num_idle, 0);
+	atomic_init(&jobqueue_p->num_blocked, 0);
+	atomic_init(&jobqueue_p->closed, 0);
+
+	int p;
+	for (p=0; p<THPOOL_NUM_PRIO; p++){
+		jobqueue_p->front[p] = NULL;
+		jobqueue_p->rear[p]  = NULL;
+		atomic_init(&jobqueue_p->depth[p], 0);
+		atomic_init(&jobqueue_p->passed[p], 0);
+	}
+
+	jobqueue_p->has_jobs = (struct bsem*)malloc(sizeof(struct bsem));
+	if (jobqueue_p->has_jobs == NULL){
+		return -1;
+	}
+	jobqueue_p->has_space = (struct bsem*)malloc(sizeof(struct bsem));
+	if (jobqueue_p->has_space == NULL){
+		free(jobqueue_p->has_jobs);
+		return -1;
+	}
+
+	if (slab_init(&jobqueue_p->slab, sizeof(struct job), config->job_slab_size) == -1){
+		free(jobqueue_p->has_space);
+		free(jobqueue_p->has_jobs);
+		return -1;
+	}
+
+	/* One ring per priority level */
+	if (jobqueue_p->type == THPOOL_QUEUE_RING){
+		for (p=0; p<THPOOL_NUM_PRIO; p++){
+			if (jobring_init(&jobqueue_p->ring[p], config->queue_capacity) == -1){
+				while (p--){
+					jobring_destroy(&jobqueue_p->ring[p]);
+				}
+				slab_destroy(&jobqueue_p->slab);
+				free(jobqueue_p->has_space);
+				free(jobqueue_p->has_jobs);
+				return -1;
+			}
+		}
+	}
+
+	/* One heap per priority level, grown as needed */
+	if (jobqueue_p->type == THPOOL_QUEUE_EDF){
+		int capacity = config->queue_capacity > 0 ? config->queue_capacity : THPOOL_RING_DEFAULT_CAPACITY;
+		for (p=0; p<THPOOL_NUM_PRIO; p++){
+			if (jobheap_init(&jobqueue_p->heap[p], capacity) == -1){
+				while (p--){
+					jobheap_destroy(&jobqueue_p->heap[p]);
+				}
+				slab_destroy(&jobqueue_p->slab);
+				free(jobqueue_p->has_space);
+				free(jobqueue_p->has_jobs);
+				return -1;
+			}
+		}
+	}
+
+	pthread_mutex_init(&(jobqueue_p->rwmutex), NULL);
+	bsem_init(jobqueue_p->has_jobs, 0);
+	bsem_init(jobqueue_p->has_space, 0);
+
+	return 0;
+}
+
+/* Clear the queue */
+static void jobqueue_clear(jobqueue* jobqueue_p){
+
+	/* Go by what is actually queued, len also counts steals and drops */
+	job* job_p;
+	while ((job_p = jobqueue_pull(jobqueue_p, 0)) != NULL){
+		slab_free(&jobqueue_p->slab, job_p);
+	}
+
+	int p;
+	for (p=0; p<THPOOL_NUM_PRIO; p++){
+		jobqueue_p->front[p] = NULL;
+		jobqueue_p->rear[p]  = NULL;
+		jobqueue_p->depth[p] = 0;
+	}
+	bsem_reset(jobqueue_p->has_jobs);
+	bsem_reset(jobqueue_p->has_space);
+	jobqueue_p->len = 0;
+
+}
+
+/* Add a chain of (allocated) jobs linked through prev to queue
+ *
+ * The list backend splices the whole chain in one critical section, the
+ * EDF backend pushes it into the level's heap in one. Only touches
+ * has_jobs when a worker is actually parked on it. The ring backend
+ * blocks the producer on has_space while the ring is full, unless
+ * may_block is 0. A blocked producer gets the rest back once the queue
+ * is closed, still counted in num_blocked.
+ *
+ * @return NULL, or the part of the chain that didn't fit in a full or
+ *         closed ring or a heap that couldn't grow
+ */
+static struct job* jobqueue_push_chain(jobqueue* jobqueue_p, struct job* first, struct job* last, int num_jobs, int prio, int may_block){
+
+	if (jobqueue_p->type == THPOOL_QUEUE_RING){
+		jobring* jobring_p = &jobqueue_p->ring[prio];
+		job* job_p = first;
+		int n;
+		for (n=0; n<num_jobs; n++){
+			/* Read the link first, the job may be pulled as soon as it is in */
+			job* next = job_p->prev;
+			while (jobring_push(jobring_p, job_p) == -1){
+				/* Ring full, announce ourselves and retry once before sleeping */
+				atomic_fetch_add(&jobqueue_p->num_blocked, 1);
+				if (jobring_push(jobring_p, job_p) == 0){
+					atomic_fetch_sub(&jobqueue_p->num_blocked, 1);
+					break;
+				}
+				/* Let workers drain what we already put in */
+				jobqueue_published(jobqueue_p, prio, n);
+				num_jobs -= n;
+				n = 0;
+				if (!may_block){
+					atomic_fetch_sub(&jobqueue_p->num_blocked, 1);
+					return job_p;
+				}
+				/* Closed, the caller disposes of the rest and lets go of num_blocked */
+				if (atomic_load(&jobqueue_p->closed)){
+					return job_p;
+				}
+				bsem_wait(jobqueue_p->has_space);
+				atomic_fetch_sub(&jobqueue_p->num_blocked, 1);
+			}
+			job_p = next;
+		}
+	}
+	else if (jobqueue_p->type == THPOOL_QUEUE_EDF){
+		jobheap* jobheap_p = &jobqueue_p->heap[prio];
+		job* job_p = first;
+		int n;
+		pthread_mutex_lock(&jobqueue_p->rwmutex);
+		for (n=0; n<num_jobs; n++){
+			job_p->seq  = jobqueue_p->seq++;
+			job_p->prio = prio;
+			if (jobheap_push(jobheap_p, job_p) == -1){
+				break;
+			}
+			job_p = job_p->prev;
+		}
+		pthread_mutex_unlock(&jobqueue_p->rwmutex);
+		if (n < num_jobs){
+			jobqueue_published(jobqueue_p, prio, n);
+			return job_p;
+		}
+	}
+	else {
+		pthread_mutex_lock(&jobqueue_p->rwmutex);
+		last->prev = NULL;
 
+		if (jobqueue_p->front[prio] == NULL){ /* if no jobs in queue */
+			jobqueue_p->front[prio] = first;
+			jobqueue_p->rear[prio]  = last;
+		}
+		else {                                /* if jobs in queue */
+			jobqueue_p->rear[prio]->prev = first;
+			jobqueue_p->rear[prio] = last;
+		}
+		pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	}
+
+	jobqueue_published(jobqueue_p, prio, num_jobs);
+	return NULL;
 }
 
-/* Add (allocated) job to queue
+/* Get next job from queue(removes it from queue)
+ *
+ * A level that has been passed over THPOOL_PRIO_AGING times while it had
+ * jobs waiting goes first, so a steady stream of higher priority work
+ * can't starve it. Otherwise levels are served from high to low, or only
+ * the high level when high_only is set.
+ *
+ * Never blocks, returns NULL when there is nothing (eligible) queued.
  */
-static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
+static struct job* jobqueue_pull(jobqueue* jobqueue_p, int high_only){
 
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	newjob->prev = NULL;
+	job* job_p;
+	int  p;
 
-	switch(jobqueue_p->len){
+	for (p=THPOOL_NUM_PRIO-1; p>THPOOL_PRIO_HIGH; p--){
+		if (atomic_load_explicit(&jobqueue_p->passed[p], memory_order_relaxed) >= THPOOL_PRIO_AGING
+		    && atomic_load_explicit(&jobqueue_p->depth[p], memory_order_relaxed) > 0){
+			job_p = jobqueue_pull_level(jobqueue_p, p);
+			if (job_p != NULL){
+				return job_p;
+			}
+		}
+	}
 
-		case 0:  /* if no jobs in queue */
-					jobqueue_p->front = newjob;
-					jobqueue_p->rear  = newjob;
-					break;
+	int num_levels = high_only ? THPOOL_PRIO_HIGH + 1 : THPOOL_NUM_PRIO;
+	for (p=THPOOL_PRIO_HIGH; p<num_levels; p++){
+		if (atomic_load_explicit(&jobqueue_p->depth[p], memory_order_relaxed) <= 0){
+			continue;
+		}
+		job_p = jobqueue_pull_level(jobqueue_p, p);
+		if (job_p != NULL){
+			return job_p;
+		}
+	}
+
+	return NULL;
+}
 
-		default: /* if jobs in queue */
-					jobqueue_p->rear->prev = newjob;
-					jobqueue_p->rear = newjob;
+/* Get first job of one priority level, the earliest deadline with EDF */
+static struct job* jobqueue_pull_level(jobqueue* jobqueue_p, int prio){
 
+	job* job_p;
+
+	if (jobqueue_p->type == THPOOL_QUEUE_RING){
+		job_p = jobring_pull(&jobqueue_p->ring[prio]);
+		if (job_p == NULL){
+			return NULL;
+		}
+	}
+	else if (jobqueue_p->type == THPOOL_QUEUE_EDF){
+		pthread_mutex_lock(&jobqueue_p->rwmutex);
+		job_p = jobheap_pop(&jobqueue_p->heap[prio]);
+		pthread_mutex_unlock(&jobqueue_p->rwmutex);
+		if (job_p == NULL){
+			return NULL;
+		}
+	}
+	else {
+		pthread_mutex_lock(&jobqueue_p->rwmutex);
+		job_p = jobqueue_p->front[prio];
+		if (job_p != NULL){
+			jobqueue_p->front[prio] = job_p->prev;
+			if (jobqueue_p->front[prio] == NULL){
+				jobqueue_p->rear[prio] = NULL;
+			}
+		}
+		pthread_mutex_unlock(&jobqueue_p->rwmutex);
+		if (job_p == NULL){
+			return NULL;
+		}
 	}
-	jobqueue_p->len++;
 
-	bsem_post(jobqueue_p->has_jobs);
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	jobqueue_taken(jobqueue_p, prio);
+
+	return job_p;
 }
 
-/* Get first job from queue(removes it from queue)
- * Notice: Caller MUST hold a mutex
+/* Get the longest queued job of one priority level that may be dropped
+ *
+ * The list and EDF backends skip jobs droppable() turns down and leave
+ * them in place, with EDF the oldest one is found by submit order. The
+ * ring backend returns its head whatever it is.
  */
-static struct job* jobqueue_pull(jobqueue* jobqueue_p){
+static struct job* jobqueue_pull_oldest(jobqueue* jobqueue_p, int prio, int (*droppable)(const struct job*)){
+
+	if (jobqueue_p->type == THPOOL_QUEUE_RING){
+		return jobqueue_pull_level(jobqueue_p, prio);
+	}
 
+	job* job_p;
 	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	job* job_p = jobqueue_p->front;
+	if (jobqueue_p->type == THPOOL_QUEUE_EDF){
+		job_p = jobheap_pop_oldest(&jobqueue_p->heap[prio], droppable);
+	}
+	else {
+		job* before_p = NULL;
+		job_p = jobqueue_p->front[prio];
+		while (job_p != NULL && !droppable(job_p)){
+			before_p = job_p;
+			job_p    = job_p->prev;
+		}
+		if (job_p != NULL){
+			if (before_p == NULL){
+				jobqueue_p->front[prio] = job_p->prev;
+			}
+			else {
+				before_p->prev = job_p->prev;
+			}
+			if (jobqueue_p->rear[prio] == job_p){
+				jobqueue_p->rear[prio] = before_p;
+			}
+		}
+	}
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	if (job_p == NULL){
+		return NULL;
+	}
 
-	switch(jobqueue_p->len){
+	jobqueue_taken(jobqueue_p, prio);
 
-		case 0:  /* if no jobs in queue */
-		  			break;
+	return job_p;
+}
 
-		case 1:  /* if one job in queue */
-					jobqueue_p->front = NULL;
-					jobqueue_p->rear  = NULL;
-					jobqueue_p->len = 0;
-					break;
+/* Count newly queued jobs, here or in a worker deque
+ *
+ * Publish before looking for idle workers, pairs with jobqueue_park().
+ * Wakes at most one parked worker per job.
+ */
+static void jobqueue_published(jobqueue* jobqueue_p, int prio, int num_jobs){
+	if (num_jobs <= 0){
+		return;
+	}
+	atomic_fetch_add(&jobqueue_p->depth[prio], num_jobs);
+	int len = atomic_fetch_add(&jobqueue_p->len, num_jobs) + num_jobs;
 
-		default: /* if >1 jobs in queue */
-					jobqueue_p->front = job_p->prev;
-					jobqueue_p->len--;
-					/* more than one job in queue -> post it */
-					bsem_post(jobqueue_p->has_jobs);
+	/* High-water mark, only contended while it is rising */
+	int len_max = atomic_load_explicit(&jobqueue_p->len_max, memory_order_relaxed);
+	while (len > len_max
+	       && !atomic_compare_exchange_weak_explicit(&jobqueue_p->len_max, &len_max, len,
+	                                                 memory_order_relaxed, memory_order_relaxed)){
+	}
 
+	int num_idle = atomic_load(&jobqueue_p->num_idle);
+	if (num_idle){
+		bsem_post_n(jobqueue_p->has_jobs, num_jobs < num_idle ? num_jobs : num_idle);
 	}
+}
 
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
-	return job_p;
+/* Count a job taken out of the queue or a worker deque
+ *
+ * Lower levels with jobs waiting age by one, the taken level starts over.
+ */
+static void jobqueue_taken(jobqueue* jobqueue_p, int prio){
+	atomic_fetch_sub(&jobqueue_p->depth[prio], 1);
+	atomic_store_explicit(&jobqueue_p->passed[prio], 0, memory_order_relaxed);
+	int p;
+	for (p=prio+1; p<THPOOL_NUM_PRIO; p++){
+		if (atomic_load_explicit(&jobqueue_p->depth[p], memory_order_relaxed) > 0){
+			atomic_fetch_add_explicit(&jobqueue_p->passed[p], 1, memory_order_relaxed);
+		}
+	}
+
+	/* more jobs queued -> pass the wakeup on */
+	if (atomic_fetch_sub(&jobqueue_p->len, 1) > 1 && atomic_load(&jobqueue_p->num_idle)){
+		bsem_post(jobqueue_p->has_jobs);
+	}
+
+	/* One slot freed up (ring slot or queue limit) -> let one blocked producer in */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&jobqueue_p->num_blocked)){
+		bsem_post(jobqueue_p->has_space);
+	}
+}
+
+/* Block the calling worker until the queue may have a job
+ *
+ * The idle count is raised before the emptiness recheck and producers read
+ * it after raising len, so either the worker sees the job or the producer
+ * sees the worker and posts has_jobs.
+ *
+ * @param timeout_ms    give up after this long, 0 waits forever
+ * @return 0, or -1 if it timed out and the queue is still empty
+ */
+static int jobqueue_park(jobqueue* jobqueue_p, atomic_int* keepalive, int timeout_ms){
+	int rc = 0;
+	atomic_fetch_add(&jobqueue_p->num_idle, 1);
+	if (atomic_load(&jobqueue_p->len) == 0 && atomic_load(keepalive)){
+		if (timeout_ms > 0){
+			rc = bsem_wait_timeout(jobqueue_p->has_jobs, timeout_ms);
+		}
+		else {
+			bsem_wait(jobqueue_p->has_jobs);
+		}
+	}
+	atomic_fetch_sub(&jobqueue_p->num_idle, 1);
+
+	/* A producer that no longer counted us has published by now */
+	if (rc == -1 && atomic_load(&jobqueue_p->len) != 0){
+		rc = 0;
+	}
+	return rc;
+}
+
+/* Refuse producers blocked for room, and any that would block from here on
+ *
+ * A producer announces itself in num_blocked before it checks closed,
+ * so it either sees the flag or is counted in the wakeups.
+ */
+static void jobqueue_close(jobqueue* jobqueue_p){
+	atomic_store(&jobqueue_p->closed, 1);
+	int num_blocked = atomic_load(&jobqueue_p->num_blocked);
+	if (num_blocked){
+		bsem_post_n(jobqueue_p->has_space, num_blocked);
+	}
 }
 
 /* Free all queue resources back to the system */
 static void jobqueue_destroy(jobqueue* jobqueue_p){
 	jobqueue_clear(jobqueue_p);
+	if (jobqueue_p->type == THPOOL_QUEUE_RING){
+		int p;
+		for (p=0; p<THPOOL_NUM_PRIO; p++){
+			jobring_destroy(&jobqueue_p->ring[p]);
+		}
+	}
+	if (jobqueue_p->type == THPOOL_QUEUE_EDF){
+		int p;
+		for (p=0; p<THPOOL_NUM_PRIO; p++){
+			jobheap_destroy(&jobqueue_p->heap[p]);
+		}
+	}
+	slab_destroy(&jobqueue_p->slab);
+	free(jobqueue_p->has_space);
 	free(jobqueue_p->has_jobs);
 }
 
+/* ============================ JOB RING ============================ */
+/* Initialize ring, capacity is rounded up to a power of two */
+static int jobring_init(jobring* jobring_p, int capacity){
+	size_t size = 2;
+	if (capacity <= 0){
+		capacity = THPOOL_RING_DEFAULT_CAPACITY;
+	}
+	while (size < (size_t)capacity){
+		size <<= 1;
+	}
+
+	jobring_p->slots = (struct ring_slot*)malloc(size * sizeof(struct ring_slot));
+	if (jobring_p->slots == NULL){
+		return -1;
+	}
+
+	size_t i;
+	for (i=0; i<size; i++){
+		atomic_init(&jobring_p->slots[i].seq, i);
+		jobring_p->slots[i].job = NULL;
+	}
+	jobring_p->mask = size - 1;
+	atomic_init(&jobring_p->enqueue_pos, 0);
+	atomic_init(&jobring_p->dequeue_pos, 0);
+
+	return 0;
+}
+
+/* Claim the next free slot and publish the job in it
+ *
+ * A slot is free for position pos when its seq equals pos, and holds a
+ * job for position pos when its seq equals pos + 1.
+ *
+ * @return 0 on success, -1 if the ring is full
+ */
+static int jobring_push(jobring* jobring_p, struct job* newjob){
+	ring_slot* slot;
+	size_t pos = atomic_load_explicit(&jobring_p->enqueue_pos, memory_order_relaxed);
+
+	for (;;){
+		slot = &jobring_p->slots[pos & jobring_p->mask];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0){
+			if (atomic_compare_exchange_weak_explicit(&jobring_p->enqueue_pos, &pos, pos + 1,
+			                                          memory_order_relaxed, memory_order_relaxed)){
+				break;
+			}
+		}
+		else if (dif < 0){
+			return -1;
+		}
+		else {
+			pos = atomic_load_explicit(&jobring_p->enqueue_pos, memory_order_relaxed);
+		}
+	}
+
+	slot->job = newjob;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+/* Take the oldest job out of the ring
+ *
+ * @return job, or NULL if the ring is empty
+ */
+static struct job* jobring_pull(jobring* jobring_p){
+	ring_slot* slot;
+	size_t pos = atomic_load_explicit(&jobring_p->dequeue_pos, memory_order_relaxed);
+
+	for (;;){
+		slot = &jobring_p->slots[pos & jobring_p->mask];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (dif == 0){
+			if (atomic_compare_exchange_weak_explicit(&jobring_p->dequeue_pos, &pos, pos + 1,
+			                                          memory_order_relaxed, memory_order_relaxed)){
+				break;
+			}
+		}
+		else if (dif < 0){
+			return NULL;
+		}
+		else {
+			pos = atomic_load_explicit(&jobring_p->dequeue_pos, memory_order_relaxed);
+		}
+	}
+
+	job* job_p = slot->job;
+	atomic_store_explicit(&slot->seq, pos + jobring_p->mask + 1, memory_order_release);
+	return job_p;
+}
+
+/* Free ring storage */
+static void jobring_destroy(jobring* jobring_p){
+	free(jobring_p->slots);
+	jobring_p->slots = NULL;
+}
+
+/* ============================ JOB HEAP ============================ */
+/* Allocate the heap array, called once per priority level */
+static int jobheap_init(jobheap* jobheap_p, int capacity){
+	jobheap_p->jobs = (struct job**)malloc(capacity * sizeof(struct job*));
+	if (jobheap_p->jobs == NULL){
+		err("jobheap_init(): Could not allocate memory for heap\n");
+		return -1;
+	}
+	jobheap_p->len      = 0;
+	jobheap_p->capacity = capacity;
+	return 0;
+}
+
+/* Add a job, called with the queue lock held
+ *
+ * @return 0 on success, -1 if the heap was full and could not grow
+ */
+static int jobheap_push(jobheap* jobheap_p, struct job* newjob_p){
+	if (jobheap_p->len == jobheap_p->capacity){
+		struct job** jobs = (struct job**)realloc(jobheap_p->jobs, 2 * jobheap_p->capacity * sizeof(struct job*));
+		if (jobs == NULL){
+			err("jobheap_push(): Could not allocate memory for heap\n");
+			return -1;
+		}
+		jobheap_p->jobs      = jobs;
+		jobheap_p->capacity *= 2;
+	}
+	jobheap_p->jobs[jobheap_p->len] = newjob_p;
+	newjob_p->heap_index = jobheap_p->len;
+	jobheap_p->len++;
+	jobheap_up(jobheap_p, newjob_p->heap_index);
+	return 0;
+}
+
+/* Take the job with the earliest deadline, called with the queue lock held */
+static struct job* jobheap_pop(jobheap* jobheap_p){
+	if (jobheap_p->len == 0){
+		return NULL;
+	}
+	job* job_p = jobheap_p->jobs[0];
+	jobheap_remove(jobheap_p, job_p);
+	return job_p;
+}
+
+/* Take the job submitted first that droppable() accepts, called with the queue lock held
+ *
+ * A linear scan, only the DROP_OLDEST overflow policy needs it.
+ */
+static struct job* jobheap_pop_oldest(jobheap* jobheap_p, int (*droppable)(const struct job*)){
+	job* job_p = NULL;
+	int i;
+	for (i=0; i<jobheap_p->len; i++){
+		if ((job_p == NULL || jobheap_p->jobs[i]->seq < job_p->seq) && droppable(jobheap_p->jobs[i])){
+			job_p = jobheap_p->jobs[i];
+		}
+	}
+	if (job_p == NULL){
+		return NULL;
+	}
+	jobheap_remove(jobheap_p, job_p);
+	return job_p;
+}
+
+/* Take a job out wherever it sits, called with the queue lock held */
+static void jobheap_remove(jobheap* jobheap_p, struct job* job_p){
+	int index = job_p->heap_index;
+	job_p->heap_index = -1;
+
+	/* Move the last job into the hole and restore order from there */
+	jobheap_p->len--;
+	if (index == jobheap_p->len){
+		return;
+	}
+	job* last_p = jobheap_p->jobs[jobheap_p->len];
+	jobheap_p->jobs[index] = last_p;
+	last_p->heap_index = index;
+	if (index > 0 && jobheap_before(last_p, jobheap_p->jobs[(index - 1) / 2])){
+		jobheap_up(jobheap_p, index);
+	}
+	else {
+		jobheap_down(jobheap_p, index);
+	}
+}
+
+/* Whether job a runs before job b, jobs without a deadline go last in FIFO order */
+static int jobheap_before(const struct job* a_p, const struct job* b_p){
+	uint64_t a_ns = a_p->deadline_ns ? a_p->deadline_ns : UINT64_MAX;
+	uint64_t b_ns = b_p->deadline_ns ? b_p->deadline_ns : UINT64_MAX;
+	return a_ns < b_ns || (a_ns == b_ns && a_p->seq < b_p->seq);
+}
+
+/* Move the job at index towards the root until its parent goes first */
+static void jobheap_up(jobheap* jobheap_p, int index){
+	job* job_p = jobheap_p->jobs[index];
+	while (index > 0){
+		int parent = (index - 1) / 2;
+		if (!jobheap_before(job_p, jobheap_p->jobs[parent])){
+			break;
+		}
+		jobheap_p->jobs[index] = jobheap_p->jobs[parent];
+		jobheap_p->jobs[index]->heap_index = index;
+		index = parent;
+	}
+	jobheap_p->jobs[index] = job_p;
+	job_p->heap_index = index;
+}
+
+/* Move the job at index towards the leaves until it goes before its children */
+static void jobheap_down(jobheap* jobheap_p, int index){
+	job* job_p = jobheap_p->jobs[index];
+	for (;;){
+		int child = 2 * index + 1;
+		if (child >= jobheap_p->len){
+			break;
+		}
+		if (child + 1 < jobheap_p->len && jobheap_before(jobheap_p->jobs[child + 1], jobheap_p->jobs[child])){
+			child++;
+		}
+		if (!jobheap_before(jobheap_p->jobs[child], job_p)){
+			break;
+		}
+		jobheap_p->jobs[index] = jobheap_p->jobs[child];
+		jobheap_p->jobs[index]->heap_index = index;
+		index = child;
+	}
+	jobheap_p->jobs[index] = job_p;
+	job_p->heap_index = index;
+}
+
+/* Free the heap array, the jobs are the queue's */
+static void jobheap_destroy(jobheap* jobheap_p){
+	free(jobheap_p->jobs);
+	jobheap_p->jobs = NULL;
+}
+
+/* =========================== JOB DEQUE ============================ */
+/* Initialize an empty deque */
+static void jobdeque_init(jobdeque* jobdeque_p){
+	int i;
+	for (i=0; i<THPOOL_DEQUE_CAPACITY; i++){
+		atomic_init(&jobdeque_p->buffer[i], NULL);
+	}
+	atomic_init(&jobdeque_p->top, 0);
+	atomic_init(&jobdeque_p->bottom, 0);
+}
+
+/* Push a job at the bottom, owner only
+ *
+ * @return 0 on success, -1 if the deque is full
+ */
+static int jobdeque_push(jobdeque* jobdeque_p, struct job* newjob){
+	long b = atomic_load_explicit(&jobdeque_p->bottom, memory_order_relaxed);
+	long t = atomic_load_explicit(&jobdeque_p->top, memory_order_acquire);
+	if (b - t >= THPOOL_DEQUE_CAPACITY){
+		return -1;
+	}
+	atomic_store_explicit(&jobdeque_p->buffer[b & (THPOOL_DEQUE_CAPACITY - 1)], newjob, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&jobdeque_p->bottom, b + 1, memory_order_relaxed);
+	return 0;
+}
+
+/* Take the newest job from the bottom, owner only
+ *
+ * @return job, or NULL if the deque is empty or a thief won the last one
+ */
+static struct job* jobdeque_take(jobdeque* jobdeque_p){
+	long b = atomic_load_explicit(&jobdeque_p->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&jobdeque_p->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long t = atomic_load_explicit(&jobdeque_p->top, memory_order_relaxed);
+
+	job* job_p = NULL;
+	if (t <= b){
+		job_p = atomic_load_explicit(&jobdeque_p->buffer[b & (THPOOL_DEQUE_CAPACITY - 1)], memory_order_relaxed);
+		if (t == b){
+			/* Last job, race the thieves for it */
+			if (!atomic_compare_exchange_strong_explicit(&jobdeque_p->top, &t, t + 1,
+			                                             memory_order_seq_cst, memory_order_relaxed)){
+				job_p = NULL;
+			}
+			atomic_store_explicit(&jobdeque_p->bottom, b + 1, memory_order_relaxed);
+		}
+	}
+	else {
+		atomic_store_explicit(&jobdeque_p->bottom, b + 1, memory_order_relaxed);
+	}
+	return job_p;
+}
+
+/* Steal the oldest job from the top, any thread
+ *
+ * @return job, or NULL if the deque is empty or another thief won
+ */
+static struct job* jobdeque_steal(jobdeque* jobdeque_p){
+	long t = atomic_load_explicit(&jobdeque_p->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long b = atomic_load_explicit(&jobdeque_p->bottom, memory_order_acquire);
+
+	if (t >= b){
+		return NULL;
+	}
+	job* job_p = atomic_load_explicit(&jobdeque_p->buffer[t & (THPOOL_DEQUE_CAPACITY - 1)], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&jobdeque_p->top, &t, t + 1,
+	                                             memory_order_seq_cst, memory_order_relaxed)){
+		return NULL;
+	}
+	return job_p;
+}
+
+/* ============================== SLAB ============================== */
+/* Preallocate nodes and chain them all into the freelist */
+static int slab_init(slab* slab_p, size_t node_size, int size){
+	if (size < 0){
+		size = 0;
+	}
+
+	slab_p->nodes     = NULL;
+	slab_p->links     = NULL;
+	slab_p->node_size = node_size;
+	slab_p->size      = (uint32_t)size;
+	atomic_init(&slab_p->head, 0);
+	if (size == 0){
+		return 0;
+	}
+
+	slab_p->nodes = (char*)malloc(size * node_size);
+	slab_p->links = (atomic_uint*)malloc(size * sizeof(atomic_uint));
+	if (slab_p->nodes == NULL || slab_p->links == NULL){
+		free(slab_p->nodes);
+		free(slab_p->links);
+		return -1;
+	}
+
+	/* Index + 1 of the next free node, 0 terminates the list */
+	uint32_t i;
+	for (i=0; i<slab_p->size; i++){
+		atomic_init(&slab_p->links[i], i + 1 < slab_p->size ? i + 2 : 0);
+	}
+	atomic_init(&slab_p->head, 1);
+
+	return 0;
+}
+
+/* Get a node, from the slab if one is free, from the heap otherwise
+ *
+ * @return node, or NULL if the heap is exhausted too
+ */
+static void* slab_alloc(slab* slab_p){
+	uint_least64_t head = atomic_load_explicit(&slab_p->head, memory_order_acquire);
+
+	while ((uint32_t)head != 0){
+		uint32_t index = (uint32_t)head - 1;
+		uint_least64_t next = (head & 0xFFFFFFFF00000000ULL) + (1ULL << 32)
+		                    + atomic_load_explicit(&slab_p->links[index], memory_order_relaxed);
+		if (atomic_compare_exchange_weak_explicit(&slab_p->head, &head, next,
+		                                          memory_order_acquire, memory_order_acquire)){
+			return slab_p->nodes + (size_t)index * slab_p->node_size;
+		}
+	}
+
+	return malloc(slab_p->node_size);
+}
+
+/* Return a node to where it came from */
+static void slab_free(slab* slab_p, void* node_p){
+	if (!slab_owns(slab_p, node_p)){
+		free(node_p);
+		return;
+	}
+
+	uint32_t index = (uint32_t)(((uintptr_t)node_p - (uintptr_t)slab_p->nodes) / slab_p->node_size);
+	uint_least64_t head = atomic_load_explicit(&slab_p->head, memory_order_relaxed);
+	uint_least64_t next;
+	do {
+		atomic_store_explicit(&slab_p->links[index], (uint32_t)head, memory_order_relaxed);
+		next = (head & 0xFFFFFFFF00000000ULL) + (1ULL << 32) + index + 1;
+	} while (!atomic_compare_exchange_weak_explicit(&slab_p->head, &head, next,
+	                                                memory_order_release, memory_order_relaxed));
+}
+
+/* Whether a node is slab storage rather than a heap fallback */
+static int slab_owns(slab* slab_p, void* node_p){
+	uintptr_t addr = (uintptr_t)node_p;
+	uintptr_t base = (uintptr_t)slab_p->nodes;
+	return addr >= base && addr < base + (uintptr_t)slab_p->size * slab_p->node_size;
+}
+
+/* Get the node at index of the slab storage */
+static void* slab_node(slab* slab_p, uint32_t index){
+	return slab_p->nodes + (size_t)index * slab_p->node_size;
+}
+
+/* Free slab storage, all nodes must have been returned */
+static void slab_destroy(slab* slab_p){
+	free(slab_p->nodes);
+	free(slab_p->links);
+	slab_p->nodes = NULL;
+	slab_p->links = NULL;
+	slab_p->size  = 0;
+}
+
 /* ======================== SYNCHRONISATION ========================= */
 /* Init semaphore to 1 or 0 */
 static void bsem_init(bsem *bsem_p, int value) {
@@ -449,40 +4205,102 @@ static void bsem_init(bsem *bsem_p, int value) {
 		err("bsem_init(): Binary semaphore can take only values 1 or 0");
 		exit(1);
 	}
-	pthread_mutex_init(&(bsem_p->mutex), NULL);
-	pthread_cond_init(&(bsem_p->cond), NULL);
-	bsem_p->v = value;
+	atomic_init(&bsem_p->v, value);
+	atomic_init(&bsem_p->num_waiters, 0);
 }
 
 /* Reset semaphore to 0 */
 static void bsem_reset(bsem *bsem_p) {
-	pthread_mutex_destroy(&(bsem_p->mutex));
-	pthread_cond_destroy(&(bsem_p->cond));
 	bsem_init(bsem_p, 0);
 }
 
-/* Post to at least one thread */
+/* Post to at least one thread
+ *
+ * Waiters announce themselves before they sleep and FUTEX_WAIT rechecks
+ * v, so a post that sees nobody waiting can skip the syscall.
+ */
 static void bsem_post(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_signal(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+	int v = 0;
+	atomic_compare_exchange_strong(&bsem_p->v, &v, 1);
+	if (atomic_load(&bsem_p->num_waiters)) {
+		futex(&bsem_p->v, FUTEX_WAKE_PRIVATE, 1, NULL);
+	}
 }
 
-/* Post to all threads */
-static void bsem_post_all(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_broadcast(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+/* Post to n threads, each waiter consumes one wakeup */
+static void bsem_post_n(bsem *bsem_p, int n) {
+	atomic_fetch_add(&bsem_p->v, n);
+	if (atomic_load(&bsem_p->num_waiters)) {
+		futex(&bsem_p->v, FUTEX_WAKE_PRIVATE, n, NULL);
+	}
 }
 
-/* Wait on semaphore until semaphore has value 0 */
+/* Wait on semaphore until it is posted, then take one wakeup */
 static void bsem_wait(bsem* bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	while (bsem_p->v != 1) {
-		pthread_cond_wait(&bsem_p->cond, &bsem_p->mutex);
+	while (bsem_take(bsem_p) == -1) {
+		atomic_fetch_add(&bsem_p->num_waiters, 1);
+		futex(&bsem_p->v, FUTEX_WAIT_PRIVATE, 0, NULL);
+		atomic_fetch_sub(&bsem_p->num_waiters, 1);
+	}
+}
+
+/* Wait at most timeout_ms for the semaphore
+ *
+ * @return 0 if a wakeup was taken, -1 on timeout
+ */
+static int bsem_wait_timeout(bsem* bsem_p, int timeout_ms) {
+	uint64_t deadline = clock_now_ns() + (uint64_t)timeout_ms * 1000000ULL;
+
+	while (bsem_take(bsem_p) == -1) {
+		uint64_t now = clock_now_ns();
+		if (now >= deadline) {
+			/* A post that raced with the timeout still counts */
+			return bsem_take(bsem_p);
+		}
+		/* FUTEX_WAIT takes a relative CLOCK_MONOTONIC timeout */
+		struct timespec timeout;
+		timeout.tv_sec  = (time_t)((deadline - now) / 1000000000ULL);
+		timeout.tv_nsec = (long)((deadline - now) % 1000000000ULL);
+		atomic_fetch_add(&bsem_p->num_waiters, 1);
+		futex(&bsem_p->v, FUTEX_WAIT_PRIVATE, 0, &timeout);
+		atomic_fetch_sub(&bsem_p->num_waiters, 1);
+	}
+	return 0;
+}
+
+/* Take one wakeup if there is one
+ *
+ * @return 0 if a wakeup was taken, -1 otherwise
+ */
+static int bsem_take(bsem* bsem_p) {
+	int v = atomic_load(&bsem_p->v);
+	while (v > 0) {
+		if (atomic_compare_exchange_weak(&bsem_p->v, &v, v - 1)) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Raw futex call, glibc has no wrapper */
+static long futex(atomic_int* uaddr, int op, int val, const struct timespec* timeout) {
+	return syscall(SYS_futex, (int*)uaddr, op, val, timeout, NULL, 0);
+}
+
+/* Absolute CLOCK_MONOTONIC time timeout_ms from now */
+static void deadline_after(struct timespec* deadline, int timeout_ms) {
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec  += timeout_ms / 1000;
+	deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L){
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
 	}
-	bsem_p->v = 0;
-	pthread_mutex_unlock(&bsem_p->mutex);
+}
+
+/* Current CLOCK_MONOTONIC time in nanoseconds */
+static uint64_t clock_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
@@ -1,12 +1,109 @@
 #ifndef _THPOOL_
 #define _THPOOL_
 
+#include <stdint.h>
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /* =================================== API ======================================= */
 typedef struct thpool_* threadpool;
+typedef struct thpool_future_* thpool_future;
+typedef struct thpool_timer_* thpool_timer;
+typedef struct thpool_group_* thpool_group;
+typedef struct thpool_graph_* thpool_graph;
+
+/* Job queue backends */
+typedef enum {
+	THPOOL_QUEUE_LIST = 0,               /* mutex protected linked list, unbounded */
+	THPOOL_QUEUE_RING,                   /* lock-free bounded MPMC ring            */
+	THPOOL_QUEUE_EDF                     /* min-heap, earliest deadline runs first */
+} thpool_queue_type;
+
+/* Job priority levels, lower value runs first */
+typedef enum {
+	THPOOL_PRIO_HIGH = 0,                /* control loops, device writes           */
+	THPOOL_PRIO_NORMAL,                  /* default for thpool_add_work()          */
+	THPOOL_PRIO_LOW,                     /* logging, storage, other background     */
+	THPOOL_NUM_PRIO
+} thpool_priority;
+
+/* What a producer gets when a bounded queue is full */
+typedef enum {
+	THPOOL_OVERFLOW_BLOCK = 0,           /* wait for room, see block_timeout_ms    */
+	THPOOL_OVERFLOW_REJECT,              /* refuse the job, add_work returns -1    */
+	THPOOL_OVERFLOW_DROP_OLDEST,         /* throw away the oldest queued jobs      */
+	THPOOL_OVERFLOW_CALLER_RUNS          /* run the job in the producer's thread   */
+} thpool_overflow;
+
+/* Threadpool creation parameters */
+typedef struct thpool_config {
+	int num_threads;                     /* number of worker threads, the minimum  */
+	int max_threads;                     /* grow up to this many, 0 for fixed size */
+	int spawn_wait_ms;                   /* queue wait that adds a worker          */
+	int idle_timeout_ms;                 /* idle time that retires a worker        */
+	thpool_queue_type queue_type;        /* job queue backend                      */
+	int queue_capacity;                  /* ring slots per priority, power of two  */
+	                                     /* (initial heap size with EDF)           */
+	int job_slab_size;                   /* preallocated job nodes, 0 disables     */
+	int future_slab_size;                /* preallocated future handles            */
+	const char* name;                    /* thread name prefix, NULL for default   */
+	unsigned long cpu_mask;              /* bit n pins to CPU n, 0 inherits        */
+	int sched_policy;                    /* SCHED_OTHER, SCHED_FIFO or SCHED_RR    */
+	int sched_priority;                  /* priority for SCHED_FIFO and SCHED_RR   */
+	int stats;                           /* time jobs for thpool_get_stats()       */
+	int queue_limit;                     /* max queued jobs, 0 for unbounded       */
+	thpool_overflow overflow;            /* policy once queue_limit is reached     */
+	int block_timeout_ms;                /* THPOOL_OVERFLOW_BLOCK, 0 waits forever */
+	int spin_us;                         /* idle spin limit before parking, 0 off  */
+} thpool_config;
+
+/* Argument bytes thpool_add_work_inline() can keep inside a job */
+#ifndef THPOOL_INLINE_ARGS_SIZE
+#define THPOOL_INLINE_ARGS_SIZE 48
+#endif
+
+/* Log-linear histogram: exact below 4 ns, then 4 buckets per power of two */
+#define THPOOL_HIST_BUCKETS 160
+
+/* Workers covered by the per-thread fields of thpool_stats */
+#define THPOOL_STATS_MAX_THREADS 64
+
+typedef struct thpool_histogram {
+	uint64_t count;                      /* samples                                */
+	uint64_t sum_ns;                     /* sum of samples, for the mean           */
+	uint64_t max_ns;                     /* largest sample                         */
+	uint64_t buckets[THPOOL_HIST_BUCKETS];
+} thpool_histogram;
+
+/* Snapshot returned by thpool_get_stats() */
+typedef struct thpool_stats {
+	int queue_depth;                     /* jobs queued, not started               */
+	int queue_depth_max;                 /* highest queue_depth since init         */
+	int num_jobs_pending;                /* queued + running                       */
+	int num_threads_alive;               /* current pool size                      */
+	int num_threads_working;             /* threads running a job                  */
+	uint64_t overflow_blocked;           /* producers that waited for room         */
+	uint64_t overflow_timed_out;         /* jobs refused after block_timeout_ms    */
+	uint64_t overflow_rejected;          /* jobs refused, THPOOL_OVERFLOW_REJECT   */
+	uint64_t overflow_dropped;           /* old jobs thrown away to make room      */
+	uint64_t overflow_caller_ran;        /* jobs run by their producer             */
+	uint64_t deadline_missed;            /* jobs that finished after their deadline */
+	thpool_histogram wait;               /* enqueue to start of run                */
+	thpool_histogram run;                /* start of run to completion             */
+	int num_threads;                     /* entries used in the arrays below       */
+	uint64_t busy_ns[THPOOL_STATS_MAX_THREADS];  /* time spent in jobs          */
+	double busy_ratio[THPOOL_STATS_MAX_THREADS]; /* busy_ns / lifetime of thread */
+} thpool_stats;
+
+/* Per task deadline counters, see thpool_get_deadline_stats() */
+typedef struct thpool_deadline_stats {
+	uint64_t num_runs;                   /* runs that had a deadline               */
+	uint64_t num_missed;                 /* runs that finished after it            */
+	uint64_t max_late_ns;                /* worst overrun                          */
+} thpool_deadline_stats;
 
 /**
  * @brief  Initialize threadpool
@@ -27,6 +124,72 @@ typedef struct thpool_* threadpool;
  */
 threadpool thpool_init(int num_threads);
 
+/**
+ * @brief  Fill a config with the defaults used by thpool_init()
+ *
+ * @param  config        config to fill
+ * @return nothing
+ */
+void thpool_config_init(thpool_config* config);
+
+/**
+ * @brief  Initialize threadpool with explicit parameters
+ *
+ * Same as thpool_init() but also selects the job queue backend. With
+ * THPOOL_QUEUE_RING, submit and pull are lock-free; producers only block
+ * when the ring is full and workers only block when it is empty.
+ *
+ * Each pool keeps its own state, so several pools can run side by side,
+ * e.g. a SCHED_FIFO pool pinned to an isolated core next to a best-effort
+ * pool on the remaining ones. Affinity and policy are applied by each
+ * worker to itself; if that fails (no CAP_SYS_NICE) the worker still
+ * starts with the inherited settings.
+ *
+ * With max_threads above num_threads the pool is elastic: a worker is
+ * added (at most one per spawn_wait_ms) when jobs wait longer than
+ * spawn_wait_ms, and a worker idle for idle_timeout_ms exits as long as
+ * more than num_threads are left.
+ *
+ * With queue_limit set, a producer that finds that many jobs queued gets
+ * the overflow policy: wait for room (at most block_timeout_ms if set,
+ * then -1), -1 right away, drop the oldest queued jobs (lowest priority
+ * first) or run its job itself. Futures, timers, fibers and other jobs
+ * somebody waits on are never dropped, with only those queued the job
+ * is refused instead. Pool threads never wait or get refused, they run
+ * the job themselves. Each outcome is
+ * counted in thpool_get_stats().
+ *
+ * An idle worker spins for a while before it parks, for about twice its
+ * recent wait between jobs and at most spin_us, so jobs arriving in quick
+ * succession skip the futex sleep and wakeup. Set spin_us to 0 to park
+ * right away and save power; single CPU systems never spin.
+ *
+ * THPOOL_QUEUE_EDF keeps each priority level in a min-heap ordered by
+ * deadline, see thpool_add_work_deadline(). Jobs without one queue behind
+ * all deadline jobs of their level in FIFO order, and jobs submitted from
+ * a worker go through the heap too instead of the worker's own deque.
+ *
+ * @example
+ *
+ *    thpool_config cfg;
+ *    thpool_config_init(&cfg);
+ *    cfg.num_threads    = 4;
+ *    cfg.queue_type     = THPOOL_QUEUE_RING;
+ *    cfg.queue_capacity = 1024;
+ *    threadpool thpool  = thpool_init_ex(&cfg);
+ *
+ *    cfg.name           = "ctrl";
+ *    cfg.cpu_mask       = 1UL << 3;
+ *    cfg.sched_policy   = SCHED_FIFO;
+ *    cfg.sched_priority = 50;
+ *    threadpool ctrl    = thpool_init_ex(&cfg);
+ *
+ * @param  config        creation parameters
+ * @return threadpool    created threadpool on success,
+ *                       NULL on error
+ */
+threadpool thpool_init_ex(const thpool_config* config);
+
 /**
  * @brief Add work to the job queue
  *
@@ -35,6 +198,7 @@ threadpool thpool_init(int num_threads);
  * a way to implement this is by passing a pointer to a structure.
  *
  * NOTICE: You have to cast both the function and argument to not get warnings.
+ * With the ring backend this call blocks while the ring is full.
  *
  * @example
  *
@@ -56,6 +220,575 @@ threadpool thpool_init(int num_threads);
  */
 int thpool_add_work(threadpool, void (*function_p)(void*), void* arg_p);
 
+/**
+ * @brief Add work to the job queue with a priority
+ *
+ * Same as thpool_add_work(), which uses THPOOL_PRIO_NORMAL. Workers take
+ * higher priority jobs first. A level that keeps being passed over while
+ * it has jobs waiting gets a turn every THPOOL_PRIO_AGING jobs, so low
+ * priority work is delayed but never starved.
+ *
+ * @example
+ *
+ *    thpool_add_work_prio(thpool, pid_update, &pid, THPOOL_PRIO_HIGH);
+ *    thpool_add_work_prio(thpool, db_insert, row, THPOOL_PRIO_LOW);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @param  prio          priority level
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_prio(threadpool, void (*function_p)(void*), void* arg_p, thpool_priority prio);
+
+/**
+ * @brief Add work that has to finish by a deadline
+ *
+ * With THPOOL_QUEUE_EDF the job queues at THPOOL_PRIO_NORMAL and workers
+ * take the job with the earliest deadline first, so a 1 ms control task
+ * overtakes a queued 50 ms display refresh. Other backends keep their
+ * FIFO order and only count the outcome.
+ *
+ * Each run is checked against its deadline when it returns and counted
+ * per function, see thpool_get_deadline_stats(). Periodic timers of an
+ * EDF pool get the start of their next period as implicit deadline.
+ *
+ * @example
+ *
+ *    uint64_t release = thpool_clock_ns();
+ *    thpool_add_work_deadline(thpool, pid_update, &pid, release + 1000000);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @param  deadline_ns   absolute CLOCK_MONOTONIC time, see thpool_clock_ns()
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_deadline(threadpool, void (*function_p)(void*), void* arg_p, uint64_t deadline_ns);
+
+/**
+ * @brief Current time on the clock deadlines are given in
+ *
+ * @return CLOCK_MONOTONIC time in ns
+ */
+uint64_t thpool_clock_ns(void);
+
+/**
+ * @brief Get the deadline counters of one task
+ *
+ * Tasks are told apart by their function. The first 64 functions that
+ * run with a deadline get their own counters, later ones only count in
+ * thpool_stats.deadline_missed.
+ *
+ * @example
+ *
+ *    thpool_deadline_stats ds;
+ *    if (thpool_get_deadline_stats(thpool, pid_update, &ds) == 0)
+ *       printf("pid missed %llu of %llu\n",
+ *              (unsigned long long)ds.num_missed, (unsigned long long)ds.num_runs);
+ *
+ * @param  threadpool    the threadpool of interest
+ * @param  function_p    function the jobs were added with
+ * @param  stats         counters to fill
+ * @return 0 on success, -1 if the function never ran with a deadline
+ */
+int thpool_get_deadline_stats(threadpool, void (*function_p)(void*), thpool_deadline_stats* stats);
+
+/**
+ * @brief Add several jobs to the job queue at once
+ *
+ * Same as calling thpool_add_work() for each pair of function_p[i] and
+ * arg_p[i], but the jobs are linked into the queue in one go and at most
+ * num_jobs idle threads are woken up.
+ *
+ * @example
+ *
+ *    void (*funcs[4])(void*);
+ *    void*  args[4];
+ *    for (int ch=0; ch<4; ch++){
+ *       funcs[ch] = sample_channel;
+ *       args[ch]  = (void*)(uintptr_t)ch;
+ *    }
+ *    thpool_add_work_batch(thpool, funcs, args, 4);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    array of num_jobs function pointers
+ * @param  arg_p         array of num_jobs arguments
+ * @param  num_jobs      number of jobs to add
+ * @return 0 on success, -1 otherwise (then no job was added).
+ */
+int thpool_add_work_batch(threadpool, void (*function_p[])(void*), void* arg_p[], int num_jobs);
+
+/**
+ * @brief Add work and get told about its completion through an fd
+ *
+ * Runs function_p(arg_p) on the pool like thpool_add_work(). Once it
+ * has run, done_p(arg_p) is queued for thpool_poll_completions(), which
+ * runs it on the thread that calls it (typically the main loop). The fd
+ * from thpool_completion_fd() turns readable whenever done callbacks are
+ * waiting, so pool results can share one epoll_wait() with sockets,
+ * UARTs and other device fds.
+ *
+ * Jobs with a done callback are never dropped by
+ * THPOOL_OVERFLOW_DROP_OLDEST. Callbacks still waiting when the pool is
+ * destroyed are not run, poll once more after thpool_wait().
+ *
+ * @example
+ *
+ *    int pool_fd = thpool_completion_fd(thpool);
+ *    struct epoll_event ev = { .events = EPOLLIN, .data.fd = pool_fd };
+ *    epoll_ctl(epfd, EPOLL_CTL_ADD, pool_fd, &ev);
+ *    ..
+ *    thpool_add_work_notify(thpool, parse_frame, send_reply, frame);
+ *    ..
+ *    n = epoll_wait(epfd, events, 16, -1);
+ *    for (i=0; i<n; i++){
+ *       if (events[i].data.fd == pool_fd)
+ *          thpool_poll_completions(thpool);   // runs send_reply(frame)
+ *       ..
+ *    }
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to run on the pool
+ * @param  done_p        pointer to function to run on completion
+ * @param  arg_p         pointer to an argument for both
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_notify(threadpool, void (*function_p)(void*), void (*done_p)(void*), void* arg_p);
+
+/**
+ * @brief Get the eventfd that signals finished thpool_add_work_notify() jobs
+ *
+ * Made on the first call and owned by the pool, don't close it. It is
+ * non-blocking and readable while done callbacks are waiting; reading it
+ * is left to thpool_poll_completions().
+ *
+ * @param  threadpool    the threadpool of interest
+ * @return file descriptor on success, -1 otherwise.
+ */
+int thpool_completion_fd(threadpool);
+
+/**
+ * @brief Run the done callbacks of finished jobs
+ *
+ * Runs them on the calling thread in the order the jobs finished and
+ * clears the completion fd. Never blocks.
+ *
+ * @param  threadpool    the threadpool of interest
+ * @return number of callbacks run
+ */
+int thpool_poll_completions(threadpool);
+
+/**
+ * @brief Add work with its arguments copied into the job
+ *
+ * Copies size bytes from args_p into the job itself, so a job taking a
+ * small struct needs neither a malloc for the struct nor one for the job
+ * (job nodes come from the pool's slab). The function gets a pointer to
+ * the copy, which is suitably aligned for any type and valid until the
+ * function returns.
+ *
+ * @example
+ *
+ *    struct dac_write { int channel; uint16_t code; };
+ *
+ *    void write_dac(void* arg){
+ *       struct dac_write* w = arg;
+ *       ..
+ *    }
+ *
+ *    struct dac_write w = { 1, 2048 };
+ *    thpool_add_work_inline(thpool, write_dac, &w, sizeof w);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  args_p        arguments to copy
+ * @param  size          bytes to copy, at most THPOOL_INLINE_ARGS_SIZE
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_inline(threadpool, void (*function_p)(void*), const void* args_p, size_t size);
+
+/**
+ * @brief Add work and get a handle to wait for just that job
+ *
+ * Like thpool_add_work(), but the function returns a result and the call
+ * returns a future that can be waited on with thpool_future_wait(),
+ * thpool_future_try_wait() or thpool_future_wait_timeout(). Handles come
+ * from a per-pool preallocated slab.
+ *
+ * Every future must be given back with thpool_future_release(), which
+ * may be done before the job has finished if the result is not needed.
+ *
+ * @example
+ *
+ *    void* filter_block(void* block){
+ *       ..
+ *       return block;
+ *    }
+ *
+ *    thpool_future f = thpool_submit(thpool, filter_block, samples);
+ *    ..                                     // do something else meanwhile
+ *    void* result;
+ *    thpool_future_wait(f, &result);
+ *    thpool_future_release(f);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return future on success, NULL otherwise.
+ */
+thpool_future thpool_submit(threadpool, void* (*function_p)(void*), void* arg_p);
+
+/**
+ * @brief Wait for a submitted job to finish
+ *
+ * @param  future        handle returned by thpool_submit()
+ * @param  result_p      where to store the job's return value, may be NULL
+ * @return 0
+ */
+int thpool_future_wait(thpool_future, void** result_p);
+
+/**
+ * @brief Check whether a submitted job has finished, without blocking
+ *
+ * @param  future        handle returned by thpool_submit()
+ * @param  result_p      where to store the job's return value, may be NULL
+ * @return 0 if the job has finished, -1 otherwise.
+ */
+int thpool_future_try_wait(thpool_future, void** result_p);
+
+/**
+ * @brief Wait at most timeout_ms for a submitted job to finish
+ *
+ * @param  future        handle returned by thpool_submit()
+ * @param  timeout_ms    milliseconds to wait, negative waits forever
+ * @param  result_p      where to store the job's return value, may be NULL
+ * @return 0 if the job has finished, -1 on timeout.
+ */
+int thpool_future_wait_timeout(thpool_future, int timeout_ms, void** result_p);
+
+/**
+ * @brief Give a future handle back to its threadpool
+ *
+ * @param  future        handle returned by thpool_submit()
+ * @return nothing
+ */
+void thpool_future_release(thpool_future);
+
+/**
+ * @brief Make a group to submit related jobs under
+ *
+ * Jobs added with thpool_add_work_group() can be waited for with
+ * thpool_wait_group() and dropped with thpool_cancel_group() without
+ * touching the rest of the pool, e.g. everything queued for one client
+ * connection or one sensor.
+ *
+ * @example
+ *
+ *    thpool_group client = thpool_group_create(thpool);
+ *    thpool_add_work_group(client, parse_frame, frame);
+ *    ..
+ *    // client went away
+ *    thpool_cancel_group(client);
+ *    thpool_wait_group(client);             // for the ones already running
+ *    thpool_group_destroy(client);
+ *
+ * @param  threadpool    threadpool the group's jobs will go to
+ * @return group on success, NULL otherwise.
+ */
+thpool_group thpool_group_create(threadpool);
+
+/**
+ * @brief Add work to the job queue as part of a group
+ *
+ * Same as thpool_add_work() on the group's threadpool, the job also
+ * counts in the group until it has run or been cancelled.
+ *
+ * @param  group         handle returned by thpool_group_create()
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_group(thpool_group, void (*function_p)(void*), void* arg_p);
+
+/**
+ * @brief Drop the group's jobs that haven't started yet
+ *
+ * Walks only the group's own queued jobs. They are taken off the books
+ * right away, so thpool_wait_group() and thpool_wait() no longer wait for
+ * them, and their queue slots are freed when a worker reaches them.
+ * Jobs already running are not interrupted.
+ *
+ * @param  group         handle returned by thpool_group_create()
+ * @return number of jobs cancelled
+ */
+int thpool_cancel_group(thpool_group);
+
+/**
+ * @brief Wait until every job of the group has finished or been cancelled
+ *
+ * Must not be called from one of the group's own jobs.
+ *
+ * @param  group         handle returned by thpool_group_create()
+ * @return nothing
+ */
+void thpool_wait_group(thpool_group);
+
+/**
+ * @brief Give a group handle back
+ *
+ * Jobs still queued in the group run as usual, cancel them first if they
+ * shouldn't. The group is freed once the last of them is done.
+ *
+ * @param  group         handle returned by thpool_group_create()
+ * @return nothing
+ */
+void thpool_group_destroy(thpool_group);
+
+/**
+ * @brief Add work to the job queue after a delay
+ *
+ * A single timer thread per pool (started with the first timer) keeps
+ * all delayed and periodic jobs in a hierarchical timer wheel with 1 ms
+ * ticks and queues them with thpool_add_work() when they are due. A job
+ * never runs early; how late it runs depends on how busy the pool is.
+ *
+ * Every handle must be given back with thpool_timer_cancel() or
+ * thpool_timer_release(), and all of them before thpool_destroy().
+ *
+ * @example
+ *
+ *    thpool_timer t = thpool_schedule_after(thpool, 500, led_off, led);
+ *    thpool_timer_release(t);             // fire and forget
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  delay_ms      milliseconds from now
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return timer handle on success, NULL otherwise.
+ */
+thpool_timer thpool_schedule_after(threadpool, int delay_ms, void (*function_p)(void*), void* arg_p);
+
+/**
+ * @brief Add work to the job queue periodically
+ *
+ * Like thpool_schedule_after(), the first run is period_ms from now and
+ * then every period_ms, on a fixed grid that doesn't drift with job run
+ * time. While one run is still queued or running the next one is skipped,
+ * so a slow job never piles up copies of itself. In a THPOOL_QUEUE_EDF
+ * pool each run is due by the start of the next period.
+ *
+ * @example
+ *
+ *    thpool_timer adc = thpool_schedule_every(thpool, 10, adc_sample, &adc0);
+ *    thpool_timer oled = thpool_schedule_every(thpool, 50, oled_refresh, NULL);
+ *    ..
+ *    thpool_timer_cancel(adc);
+ *    thpool_timer_cancel(oled);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  period_ms     milliseconds between runs, must be positive
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @return timer handle on success, NULL otherwise.
+ */
+thpool_timer thpool_schedule_every(threadpool, int period_ms, void (*function_p)(void*), void* arg_p);
+
+/**
+ * @brief Stop a timer and give its handle back
+ *
+ * No new run is queued after this returns, a run that was already queued
+ * is skipped if it hasn't started yet.
+ *
+ * @param  timer         handle returned by thpool_schedule_after/every()
+ * @return 0 if the timer was still pending, -1 if a one shot had
+ *         already fired.
+ */
+int thpool_timer_cancel(thpool_timer);
+
+/**
+ * @brief Give a timer handle back without stopping the timer
+ *
+ * One shots still fire, periodic timers keep running until the pool is
+ * destroyed.
+ *
+ * @param  timer         handle returned by thpool_schedule_after/every()
+ * @return nothing
+ */
+void thpool_timer_release(thpool_timer);
+
+/**
+ * @brief Run a function over a range of indices using the whole pool
+ *
+ * Splits [begin, end) into chunks and calls function_p(chunk_begin,
+ * chunk_end, ctx) for each of them on the pool's threads. The calling
+ * thread takes chunks too, and the call returns once every index has been
+ * processed. Chunks shrink as the range drains so uneven work balances
+ * out, but are never smaller than grain (except the last one).
+ *
+ * May be called from inside a job of the same pool.
+ *
+ * @example
+ *
+ *    void scale(long begin, long end, void* ctx){
+ *       float* samples = ctx;
+ *       for (long i=begin; i<end; i++) samples[i] *= 0.5f;
+ *    }
+ *
+ *    thpool_parallel_for(thpool, 0, 4096, 256, scale, samples);
+ *
+ * @param  threadpool    threadpool to run the chunks on
+ * @param  begin         first index
+ * @param  end           one past the last index
+ * @param  grain         smallest chunk size, <= 0 picks one from the range
+ * @param  function_p    function processing one chunk
+ * @param  ctx           passed through to function_p
+ * @return nothing
+ */
+void thpool_parallel_for(threadpool, long begin, long end, long grain,
+                         void (*function_p)(long begin, long end, void* ctx), void* ctx);
+
+/**
+ * @brief Run a function as a fiber on the pool
+ *
+ * A fiber is a job with its own stack that can block without holding on
+ * to a worker: thpool_fiber_sleep(), thpool_fiber_wait_fd() and
+ * thpool_fiber_yield() switch back to the worker, which picks up other
+ * jobs meanwhile, and the fiber is queued again once its time is up or
+ * its fd is ready. Hundreds of device loops can share a few workers
+ * that way. Sleeps go through the pool's timer wheel, fd waits through
+ * one epoll thread per pool (started with the first wait).
+ *
+ * A fiber may carry on on another worker after each of these calls, so
+ * it must not hold locks across them nor keep thread-local pointers.
+ * Blocking calls other than the three above still block the worker.
+ * Fibers that have not finished when the pool is destroyed are freed
+ * without running to the end.
+ *
+ * @example
+ *
+ *    void uart_loop(void* arg){
+ *       struct uart* u = arg;
+ *       for (;;){
+ *          thpool_fiber_wait_fd(u->fd, POLLIN);
+ *          n = read(u->fd, buf, sizeof buf);
+ *          ..
+ *       }
+ *    }
+ *
+ *    thpool_fiber_spawn(thpool, uart_loop, &uart1, 0);
+ *
+ * @param  threadpool    threadpool the fiber runs on
+ * @param  function_p    pointer to function the fiber runs
+ * @param  arg_p         pointer to an argument
+ * @param  stack_size    stack bytes, 0 for the 64 KiB default
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_fiber_spawn(threadpool, void (*function_p)(void*), void* arg_p, size_t stack_size);
+
+/**
+ * @brief Let other jobs and fibers run, then carry on
+ *
+ * Outside a fiber this is sched_yield().
+ *
+ * @return nothing
+ */
+void thpool_fiber_yield(void);
+
+/**
+ * @brief Sleep for ms milliseconds, parking only the fiber
+ *
+ * Outside a fiber this sleeps the calling thread. A fiber sleeping while
+ * the pool is destroyed is not resumed again.
+ *
+ * @param  ms            milliseconds to sleep, at 1 ms resolution
+ * @return 0 after sleeping, -1 if the wakeup could not be scheduled
+ */
+int thpool_fiber_sleep(int ms);
+
+/**
+ * @brief Wait for an fd to become ready, parking only the fiber
+ *
+ * Only one fiber may wait on a given fd at a time. Outside a fiber this
+ * is poll() on the fd.
+ *
+ * @param  fd            file descriptor, must support epoll (not a regular file)
+ * @param  events        POLLIN, POLLOUT, .. (same values as EPOLLIN, EPOLLOUT, ..)
+ * @return events the fd is ready for, -1 if it can't be waited on.
+ */
+int thpool_fiber_wait_fd(int fd, int events);
+
+/**
+ * @brief Make an empty task graph
+ *
+ * A task graph is a set of jobs (nodes) with dependencies (edges) that
+ * is declared once and can then be run any number of times. A node is
+ * queued as soon as its last predecessor finishes, there is no barrier
+ * between stages, and a worker that finishes a node carries on with one
+ * of the nodes it released itself.
+ *
+ * @example
+ *
+ *    thpool_graph g = thpool_graph_create(thpool);
+ *    int adc0 = thpool_graph_add_node(g, read_adc, &ch[0]);
+ *    int adc1 = thpool_graph_add_node(g, read_adc, &ch[1]);
+ *    int pid  = thpool_graph_add_node(g, run_pid, &loop);
+ *    int dac  = thpool_graph_add_node(g, write_dac, &loop);
+ *    int log  = thpool_graph_add_node(g, log_frame, &loop);
+ *    thpool_graph_add_edge(g, adc0, pid);
+ *    thpool_graph_add_edge(g, adc1, pid);
+ *    thpool_graph_add_edge(g, pid, dac);
+ *    thpool_graph_add_edge(g, pid, log);
+ *    while (running){
+ *       thpool_graph_run(g);                // one frame
+ *    }
+ *    thpool_graph_destroy(g);
+ *
+ * @param  threadpool    threadpool the nodes will run on
+ * @return graph on success, NULL otherwise.
+ */
+thpool_graph thpool_graph_create(threadpool);
+
+/**
+ * @brief Add a node to a task graph
+ *
+ * @param  graph         handle returned by thpool_graph_create()
+ * @param  function_p    pointer to function the node runs
+ * @param  arg_p         pointer to an argument
+ * @return node index on success, -1 otherwise.
+ */
+int thpool_graph_add_node(thpool_graph, void (*function_p)(void*), void* arg_p);
+
+/**
+ * @brief Have node "to" run only after node "from" has finished
+ *
+ * @param  graph         handle returned by thpool_graph_create()
+ * @param  from          node index returned by thpool_graph_add_node()
+ * @param  to            node index returned by thpool_graph_add_node()
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_graph_add_edge(thpool_graph, int from, int to);
+
+/**
+ * @brief Run every node of a task graph once and wait for them
+ *
+ * The first run after nodes or edges were added checks the graph for
+ * cycles. Blocks the calling thread, so call it from outside the pool or
+ * make sure the pool has other workers left to run the nodes.
+ *
+ * @param  graph         handle returned by thpool_graph_create()
+ * @return 0 on success, -1 if the graph has a cycle or is already running.
+ */
+int thpool_graph_run(thpool_graph);
+
+/**
+ * @brief Free a task graph, must not be running
+ *
+ * @param  graph         handle returned by thpool_graph_create()
+ * @return nothing
+ */
+void thpool_graph_destroy(thpool_graph);
+
 /**
  * @brief Wait for all queued jobs to finish
  *
@@ -63,11 +796,8 @@ int thpool_add_work(threadpool, void (*function_p)(void*), void* arg_p);
  * Once the queue is empty and all work has completed, the calling thread
  * (probably the main program) will continue.
  *
- * Smart polling is used in wait. The polling is initially 0 - meaning that
- * there is virtually no polling at all. If after 1 seconds the threads
- * haven't finished, the polling interval starts growing exponentially
- * until it reaches max_secs seconds. Then it jumps down to a maximum polling
- * interval assuming that heavy processing is being used in the threadpool.
+ * The pool counts its jobs like one big thpool_group, use
+ * thpool_wait_group() to wait for only some of them.
  *
  * @example
  *
@@ -86,11 +816,16 @@ int thpool_add_work(threadpool, void (*function_p)(void*), void* arg_p);
 void thpool_wait(threadpool);
 
 /**
- * @brief Pauses all threads immediately
+ * @brief Pauses all threads between jobs
+ *
+ * Jobs already running are never interrupted: the call returns once they
+ * have finished, and no thread starts another job until thpool_resume
+ * is called. Called from inside a job of the same pool, it waits for all
+ * other jobs and returns while the calling job keeps running.
  *
- * The threads will be paused no matter if they are idle or working.
- * The threads return to their previous states once thpool_resume
- * is called.
+ * Pauses nest, so two drivers can each pause around their own bus
+ * reconfiguration; threads resume after the matching number of
+ * thpool_resume calls.
  *
  * While the thread is being paused, new work can be added.
  *
@@ -111,6 +846,8 @@ void thpool_pause(threadpool);
 /**
  * @brief Unpauses all threads if they are paused
  *
+ * Paused threads are woken right away and pick up queued work.
+ *
  * @example
  *    ..
  *    thpool_pause(thpool);
@@ -123,11 +860,52 @@ void thpool_pause(threadpool);
  */
 void thpool_resume(threadpool);
 
+/**
+ * @brief Take a snapshot of the pool's counters
+ *
+ * Queue depth and thread counts are always kept. The wait and run
+ * histograms and busy times need the stats config flag: jobs are then
+ * stamped when queued, when a thread starts them and when they complete.
+ * Only jobs run by the pool's own threads are timed.
+ *
+ * Counters are read one by one without stopping the pool, so this is
+ * cheap to call from a monitoring thread. Arrays are indexed by thread
+ * slot; elastic pools report slots without a thread as idle.
+ *
+ * @example
+ *
+ *    thpool_stats st;
+ *    thpool_get_stats(thpool, &st);
+ *    printf("depth %d/%d wait p99 %llu ns run p99 %llu ns\n",
+ *           st.queue_depth, st.queue_depth_max,
+ *           (unsigned long long)thpool_histogram_percentile(&st.wait, 0.99),
+ *           (unsigned long long)thpool_histogram_percentile(&st.run, 0.99));
+ *
+ * @param threadpool     the threadpool of interest
+ * @param stats          snapshot to fill
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_get_stats(threadpool, thpool_stats* stats);
+
+/**
+ * @brief Estimate a percentile from a histogram
+ *
+ * @param histogram      histogram from a thpool_stats snapshot
+ * @param fraction       0.5 for the median, 0.99 for p99 and so on
+ * @return upper bound of the bucket holding that sample in ns, within
+ *         25% of the real value; 0 for an empty histogram.
+ */
+uint64_t thpool_histogram_percentile(const thpool_histogram* histogram, double fraction);
+
 /**
  * @brief Destroy the threadpool
  *
  * This will wait for the currently active threads to finish and then 'kill'
- * the whole threadpool to free up memory.
+ * the whole threadpool to free up memory. Idle threads are woken at once
+ * and every thread is joined, so when this returns no thread of the pool
+ * is left running. Jobs still queued are dropped. Producers blocked
+ * waiting for room in a bounded queue or a full ring are woken and their
+ * call returns -1.
  *
  * @example
  * int main() {
@@ -164,6 +942,39 @@ void thpool_destroy(threadpool);
  */
 int thpool_num_threads_working(threadpool);
 
+/**
+ * @brief Show number of threads in the pool
+ *
+ * Fixed-size pools always report num_threads, elastic pools report
+ * their current size between num_threads and max_threads.
+ *
+ * @example
+ *    printf("Pool size: %d, busy: %d\n",
+ *           thpool_num_threads_alive(thpool),
+ *           thpool_num_threads_working(thpool));
+ *
+ * @param threadpool     the threadpool of interest
+ * @return integer       number of threads alive
+ */
+int thpool_num_threads_alive(threadpool);
+
+/**
+ * @brief Show number of jobs waiting at a priority level
+ *
+ * Counts jobs queued but not yet picked up by a thread.
+ *
+ * @example
+ *    printf("Waiting: high %d normal %d low %d\n",
+ *           thpool_queue_depth(thpool, THPOOL_PRIO_HIGH),
+ *           thpool_queue_depth(thpool, THPOOL_PRIO_NORMAL),
+ *           thpool_queue_depth(thpool, THPOOL_PRIO_LOW));
+ *
+ * @param threadpool     the threadpool of interest
+ * @param prio           priority level
+ * @return integer       number of jobs waiting at that level
+ */
+int thpool_queue_depth(threadpool, thpool_priority prio);
+
 #ifdef __cplusplus
 }
 #endif
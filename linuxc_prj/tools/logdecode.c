@@ -0,0 +1,262 @@
+// tools/logdecode.c
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "logger_bin.h"
+
+// Largest format id a log can use
+#define MAX_FORMATS 1024
+
+// Largest decoded line
+#define LINE_SIZE 4096
+
+static const char *level_strings[] = {"DEBUG", "INFO", "WARN", "ERROR", "FATAL"};
+
+// Format strings of the current run, index is the format id
+static char *formats[MAX_FORMATS + 1];
+
+/**
+ * @brief Forget the format strings of the previous run
+ */
+static void reset_formats(void) {
+    for (int i = 0; i <= MAX_FORMATS; i++) {
+        free(formats[i]);
+        formats[i] = NULL;
+    }
+}
+
+/**
+ * @brief Read an 8 byte argument
+ * @param p Read position, moved past the argument
+ * @param end End of the payload
+ * @param value Receives the argument
+ * @return 0 on success, -1 if the payload is too short
+ */
+static int read_arg(const uint8_t **p, const uint8_t *end, void *value) {
+    if (end - *p < 8) {
+        return -1;
+    }
+    memcpy(value, *p, 8);
+    *p += 8;
+    return 0;
+}
+
+/**
+ * @brief Format one record the way the logging call would have
+ * @param format Format string of the record's id
+ * @param p Raw arguments
+ * @param end End of the raw arguments
+ * @param out Output buffer
+ * @param size Size of the output buffer
+ * @return 0 on success, -1 if the arguments don't match the format
+ */
+static int format_line(const char *format, const uint8_t *p, const uint8_t *end, char *out, size_t size) {
+    size_t len = 0;
+
+    while (*format != '\0' && len + 1 < size) {
+        if (*format != '%') {
+            out[len++] = *format++;
+            continue;
+        }
+
+        LogBinSpec spec;
+        format = log_bin_spec(format, &spec);
+        if (spec.kind == LOG_ARG_NONE || spec.kind == LOG_ARG_TEXT) {
+            // "%%", the logger never records the others
+            int n = snprintf(out + len, size - len, "%s", spec.conv == '%' ? "%" : "");
+            len += n > 0 ? (size_t)n : 0;
+            continue;
+        }
+
+        int64_t stars[2] = {0, 0};
+        for (int s = 0; s < spec.num_stars; s++) {
+            if (read_arg(&p, end, &stars[s]) == -1) {
+                return -1;
+            }
+        }
+
+        // Rebuild the conversion with a length modifier for the stored width
+        char conv[64];
+        int mod = spec.mod < (int)sizeof(conv) - 4 ? spec.mod : (int)sizeof(conv) - 4;
+        memcpy(conv, spec.start, mod);
+        int n = mod;
+        if (spec.kind == LOG_ARG_INT || spec.kind == LOG_ARG_UINT) {
+            if (spec.conv != 'c') {
+                conv[n++] = 'l';
+                conv[n++] = 'l';
+            }
+        }
+        conv[n++] = spec.conv;
+        conv[n] = '\0';
+
+        char *dst = out + len;
+        size_t room = size - len;
+        int s0 = (int)stars[0];
+        int s1 = (int)stars[1];
+        int64_t ival;
+        uint64_t uval;
+        double dval;
+        switch (spec.kind) {
+            case LOG_ARG_INT:
+                if (read_arg(&p, end, &ival) == -1) {
+                    return -1;
+                }
+                if (spec.conv == 'c') {
+                    n = spec.num_stars == 2 ? snprintf(dst, room, conv, s0, s1, (int)ival)
+                      : spec.num_stars == 1 ? snprintf(dst, room, conv, s0, (int)ival)
+                      : snprintf(dst, room, conv, (int)ival);
+                } else {
+                    n = spec.num_stars == 2 ? snprintf(dst, room, conv, s0, s1, (long long)ival)
+                      : spec.num_stars == 1 ? snprintf(dst, room, conv, s0, (long long)ival)
+                      : snprintf(dst, room, conv, (long long)ival);
+                }
+                break;
+            case LOG_ARG_UINT:
+                if (read_arg(&p, end, &uval) == -1) {
+                    return -1;
+                }
+                n = spec.num_stars == 2 ? snprintf(dst, room, conv, s0, s1, (unsigned long long)uval)
+                  : spec.num_stars == 1 ? snprintf(dst, room, conv, s0, (unsigned long long)uval)
+                  : snprintf(dst, room, conv, (unsigned long long)uval);
+                break;
+            case LOG_ARG_DOUBLE:
+                if (read_arg(&p, end, &dval) == -1) {
+                    return -1;
+                }
+                n = spec.num_stars == 2 ? snprintf(dst, room, conv, s0, s1, dval)
+                  : spec.num_stars == 1 ? snprintf(dst, room, conv, s0, dval)
+                  : snprintf(dst, room, conv, dval);
+                break;
+            case LOG_ARG_PTR:
+                if (read_arg(&p, end, &uval) == -1) {
+                    return -1;
+                }
+                // The pointer may be 8 bytes from a target with 4 byte pointers
+                n = uval == 0 ? snprintf(dst, room, "(nil)") : snprintf(dst, room, "0x%llx", (unsigned long long)uval);
+                break;
+            case LOG_ARG_STR: {
+                uint16_t slen;
+                if (end - p < 2) {
+                    return -1;
+                }
+                memcpy(&slen, p, 2);
+                p += 2;
+                if (end - p < slen) {
+                    return -1;
+                }
+                static char str[UINT16_MAX + 1];
+                memcpy(str, p, slen);
+                str[slen] = '\0';
+                p += slen;
+                n = spec.num_stars == 2 ? snprintf(dst, room, conv, s0, s1, str)
+                  : spec.num_stars == 1 ? snprintf(dst, room, conv, s0, str)
+                  : snprintf(dst, room, conv, str);
+                break;
+            }
+            default:
+                n = 0;
+                break;
+        }
+        if (n > 0) {
+            len += (size_t)n < room ? (size_t)n : room - 1;
+        }
+    }
+    out[len] = '\0';
+    return p == end ? 0 : -1;
+}
+
+/**
+ * @brief Print a LINE record as the text logger would have
+ * @param record Record header
+ * @param payload Raw arguments
+ */
+static void print_line(const LogBinRecord *record, const uint8_t *payload) {
+    time_t sec = (time_t)(record->time_ns / 1000000000ULL);
+    struct tm tm_info;
+    char time_str[32];
+    localtime_r(&sec, &tm_info);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm_info);
+
+    const char *level = record->level < 5 ? level_strings[record->level] : "?";
+    char line[LINE_SIZE];
+    if (record->id == 0 || record->id > MAX_FORMATS || formats[record->id] == NULL) {
+        snprintf(line, sizeof(line), "<unknown format %u>", (unsigned)record->id);
+    } else if (format_line(formats[record->id], payload, payload + record->size, line, sizeof(line)) == -1) {
+        snprintf(line, sizeof(line), "<bad arguments for format %u: %s>", (unsigned)record->id, formats[record->id]);
+    }
+    printf("[%s.%06u] [%s] %s\n", time_str, (unsigned)(record->time_ns % 1000000000ULL / 1000), level, line);
+}
+
+/**
+ * @brief Decode a binary log
+ *
+ * Usage: logdecode [file]
+ *
+ * Reads standard input without a file. Lines are printed as the text
+ * logger prints them with microsecond timestamps, in the order they were
+ * written, which is per thread rather than global.
+ */
+int main(int argc, char *argv[]) {
+    FILE *file = stdin;
+    if (argc > 1 && strcmp(argv[1], "-") != 0) {
+        file = fopen(argv[1], "rb");
+        if (file == NULL) {
+            fprintf(stderr, "Failed to open binary log file: %s\n", argv[1]);
+            return 1;
+        }
+    }
+
+    static uint8_t payload[UINT16_MAX + 1];
+    LogBinRecord record;
+    int started = 0;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (fread(payload, 1, record.size, file) != record.size) {
+            fprintf(stderr, "Truncated record at the end of the log\n");
+            break;
+        }
+
+        switch (record.type) {
+            case LOG_BIN_START:
+                if (record.id != LOG_BIN_MAGIC) {
+                    fprintf(stderr, "Not a binary log, or written with another byte order\n");
+                    return 1;
+                }
+                reset_formats();
+                started = 1;
+                break;
+            case LOG_BIN_FORMAT:
+                if (record.id > 0 && record.id <= MAX_FORMATS) {
+                    free(formats[record.id]);
+                    formats[record.id] = malloc(record.size + 1);
+                    if (formats[record.id] != NULL) {
+                        memcpy(formats[record.id], payload, record.size);
+                        formats[record.id][record.size] = '\0';
+                    }
+                }
+                break;
+            case LOG_BIN_LINE:
+                print_line(&record, payload);
+                break;
+            default:
+                fprintf(stderr, "Unknown record type %u\n", (unsigned)record.type);
+                break;
+        }
+        if (!started) {
+            fprintf(stderr, "Not a binary log\n");
+            return 1;
+        }
+    }
+
+    reset_formats();
+    if (file != stdin) {
+        fclose(file);
+    }
+    return 0;
+}